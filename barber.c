@@ -1,11 +1,30 @@
 #include "barber.h"
 
+// Script wide options (set from the command line in main), fields left out start at zero
+ShellOptions options = {
+    .capture = {.log_fd = -1, .index_fd = -1},
+    .kill_after_ns = TIMEOUT_KILL_GRACE_NS,
+    .limits = {RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY},
+    .journal = {.fd = -1},
+    .profile = {.context = -1},
+    .files = {.inotify_fd = -1},
+    .sched = {.policy = -1},
+};
+
 // Helper Method: create local variable
 LocalVariable *create_local_variable(char *var, char *val)
 {
     LocalVariable *newVar = (LocalVariable *)malloc(sizeof(LocalVariable));
+    if (newVar == NULL)
+    {
+        return NULL;
+    }
     newVar->var = strdup(var);
     newVar->val = strdup(val);
+    newVar->exported = 0;
+    newVar->entry = NULL;
+    newVar->env_index = -1;
+    newVar->changed = 0;
     newVar->next = NULL;
     return newVar;
 }
@@ -14,8 +33,14 @@ LocalVariable *create_local_variable(char *var, char *val)
 int add_local_variable(char *var, char *val, LocalVariableList *local)
 {
     LocalVariable *newVar = create_local_variable(var, val);
-    if (newVar->var == NULL || newVar->val == NULL)
+    if (newVar == NULL || newVar->var == NULL || newVar->val == NULL)
     {
+        if (newVar != NULL)
+        {
+            free(newVar->var);
+            free(newVar->val);
+            free(newVar);
+        }
         return 0;
     }
     // Save head if first variable
@@ -48,6 +73,185 @@ LocalVariable *find_local_var(LocalVariableList *local, char *var)
     return NULL;
 }
 
+// Helper Method: refresh the envp slot of an exported variable (only that slot changes)
+int update_envp_entry(LocalVariableList *local, LocalVariable *variable)
+{
+    char *entry = malloc(strlen(variable->var) + strlen(variable->val) + 2);
+    if (entry == NULL)
+    {
+        return 0;
+    }
+    sprintf(entry, "%s=%s", variable->var, variable->val);
+
+    // Newly exported, append a slot
+    if (variable->env_index < 0)
+    {
+        if (local->envp_count + 1 >= local->envp_cap)
+        {
+            int cap = local->envp_cap ? local->envp_cap * 2 : 64;
+            char **grown = realloc(local->envp, sizeof(char *) * cap);
+            if (grown == NULL)
+            {
+                free(entry);
+                return 0;
+            }
+            local->envp = grown;
+            local->envp_cap = cap;
+        }
+        variable->env_index = local->envp_count++;
+        local->envp[local->envp_count] = NULL;
+    }
+    free(variable->entry);
+    variable->entry = entry;
+    local->envp[variable->env_index] = entry;
+    return 1;
+}
+
+// Helper Method: remember a variable for the next journal record
+int note_variable_change(LocalVariableList *local, LocalVariable *variable)
+{
+    if (local->changed_count == local->changed_cap)
+    {
+        int cap = local->changed_cap ? local->changed_cap * 2 : 16;
+        LocalVariable **grown = realloc(local->changed, sizeof(LocalVariable *) * cap);
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        local->changed = grown;
+        local->changed_cap = cap;
+    }
+    local->changed[local->changed_count++] = variable;
+    variable->changed = 1;
+    return 1;
+}
+
+// Helper Method: set variable value, creating it if needed (exported stays set once on)
+int set_variable(LocalVariableList *local, char *var, char *val, int exported)
+{
+    LocalVariable *variable = find_local_var(local, var);
+    if (variable == NULL)
+    {
+        if (!add_local_variable(var, val, local))
+        {
+            return 0;
+        }
+        variable = local->end;
+    }
+    else if (variable->val != val)
+    {
+        char *copy = strdup(val);
+        if (copy == NULL)
+        {
+            return 0;
+        }
+        free(variable->val);
+        variable->val = copy;
+    }
+    if (exported)
+    {
+        variable->exported = 1;
+    }
+    if (local->track_changes && !variable->changed && !note_variable_change(local, variable))
+    {
+        return 0;
+    }
+    if (variable->exported)
+    {
+        return update_envp_entry(local, variable);
+    }
+    return 1;
+}
+
+// Helper Method: look up variable value (NULL if unset)
+char *get_variable(LocalVariableList *local, char *var)
+{
+    LocalVariable *variable = find_local_var(local, var);
+    return variable != NULL ? variable->val : NULL;
+}
+
+// Helper Method: import inherited environment as exported variables
+int import_environment(LocalVariableList *local)
+{
+    for (char **env = environ; *env != NULL; env++)
+    {
+        char *copy = strdup(*env);
+        if (copy == NULL)
+        {
+            return 0;
+        }
+        char *equals = strchr(copy, '=');
+        if (equals != NULL)
+        {
+            *equals = '\0';
+            if (!set_variable(local, copy, equals + 1, 1))
+            {
+                free(copy);
+                return 0;
+            }
+        }
+        free(copy);
+    }
+
+    // Keep a valid (empty) envp even with no environment
+    if (local->envp == NULL)
+    {
+        local->envp = calloc(64, sizeof(char *));
+        local->envp_cap = 64;
+    }
+    return local->envp != NULL;
+}
+
+// Helper Method: check for a NAME=value assignment word
+int is_assignment(const char *arg)
+{
+    if (arg == NULL || !(arg[0] == '_' || (arg[0] >= 'A' && arg[0] <= 'Z') || (arg[0] >= 'a' && arg[0] <= 'z')))
+    {
+        return 0;
+    }
+    for (const char *c = arg + 1; *c != '\0'; c++)
+    {
+        if (*c == '=')
+        {
+            return 1;
+        }
+        if (!(*c == '_' || (*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9')))
+        {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Helper Method: envp for one command, cached envp with NAME=value overrides applied
+// Returns a new pointer array (entries are borrowed), caller frees
+char **build_override_envp(LocalVariableList *local, char **overrides, int override_count)
+{
+    char **envp = malloc(sizeof(char *) * (local->envp_count + override_count + 1));
+    if (envp == NULL)
+    {
+        return NULL;
+    }
+    memcpy(envp, local->envp, sizeof(char *) * local->envp_count);
+    int count = local->envp_count;
+    for (int i = 0; i < override_count; i++)
+    {
+        size_t name_len = strchr(overrides[i], '=') - overrides[i] + 1;
+        int j = 0;
+        while (j < count && strncmp(envp[j], overrides[i], name_len) != 0)
+        {
+            j++;
+        }
+        envp[j] = overrides[i];
+        if (j == count)
+        {
+            count++;
+        }
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
 // Helper Method: free all local var data
 void free_local_variables(LocalVariableList *local)
 {
@@ -57,27 +261,42 @@ void free_local_variables(LocalVariableList *local)
         LocalVariable *next = curr->next;
         free(curr->var);
         free(curr->val);
+        free(curr->entry);
         free(curr);
         curr = next;
     }
+    free(local->envp);
+    free(local->changed);
     local->head = NULL;
     local->end = NULL;
     local->size = 0;
     free(local);
 }
 
+// Helper Method: FNV-1a hash of a string
+unsigned int hash_string(const char *str)
+{
+    unsigned int hash = 2166136261u;
+    while (*str)
+    {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 // Helper method: Create HistoryItem
 HistoryItem *create_history_item(char **args, int arg_count)
 {
-    HistoryItem *newHistory = (HistoryItem *)malloc(sizeof(HistoryItem));
+    HistoryItem *newHistory = (HistoryItem *)calloc(1, sizeof(HistoryItem));
     if (newHistory == NULL)
     {
         fprintf(stderr, "Error: Could not malloc HistoryItem\n");
         return NULL;
     }
 
-    // Copy args into HistoryItem args array
-    newHistory->args = (char **)malloc(sizeof(char *) * arg_count);
+    // Copy args into HistoryItem args array (NULL terminated so it can be replayed with exec)
+    newHistory->args = (char **)malloc(sizeof(char *) * (arg_count + 1));
     if (newHistory->args == NULL)
     {
         fprintf(stderr, "Error: Could not malloc HistoryItem->args\n");
@@ -85,978 +304,7609 @@ HistoryItem *create_history_item(char **args, int arg_count)
         return NULL;
     }
 
+    size_t line_len = 0;
     for (int i = 0; i < arg_count; i++)
     {
         newHistory->args[i] = strdup(args[i]); // Duplicate the string
         if (newHistory->args[i] == NULL)
         {
             fprintf(stderr, "Error: Could not malloc HistoryItem->args copy\n");
+            for (int j = 0; j < i; j++)
+            {
+                free(newHistory->args[j]);
+            }
             free(newHistory->args);
             free(newHistory);
             return NULL;
         }
+        line_len += strlen(args[i]) + 1;
+    }
+    newHistory->args[arg_count] = NULL;
+
+    // Joined line is what search and de-duplication look at
+    newHistory->line = malloc(line_len + 1);
+    if (newHistory->line == NULL)
+    {
+        fprintf(stderr, "Error: Could not malloc HistoryItem->line\n");
+        for (int i = 0; i < arg_count; i++)
+        {
+            free(newHistory->args[i]);
+        }
+        free(newHistory->args);
+        free(newHistory);
+        return NULL;
+    }
+    // Append at a running end, strcat would rescan the line for every argument
+    char *end = newHistory->line;
+    *end = '\0';
+    for (int i = 0; i < arg_count; i++)
+    {
+        if (i > 0)
+        {
+            *end++ = ' ';
+        }
+        end = stpcpy(end, args[i]);
     }
 
     // Set other vars
     newHistory->arg_count = arg_count;
-    newHistory->next = NULL;
 
     return newHistory;
 }
 
-// Helper Method: Find index of historyItem in History (if exists)
-int history_contains(History *history, HistoryItem *history_item)
+// Helper Method: Free one HistoryItem
+void free_history_item(HistoryItem *item)
 {
-    // Loop through history to find item
-    HistoryItem *curr = history->head;
-    int index = 0;
+    for (int i = 0; i < item->arg_count; i++)
+    {
+        free(item->args[i]);
+    }
+    free(item->args);
+    free(item->line);
+    free(item);
+}
+
+// Helper Method: Find HistoryItem with identical line (if exists)
+HistoryItem *history_lookup(History *history, const char *line)
+{
+    if (history->line_slots == 0)
+    {
+        return NULL;
+    }
+    HistoryItem *curr = history->line_table[hash_string(line) & (history->line_slots - 1)];
     while (curr != NULL)
     {
-        if (curr->arg_count == history_item->arg_count)
+        if (strcmp(curr->line, line) == 0)
         {
-            int match = 1;
-            for (int j = 0; j < curr->arg_count; j++)
-            {
-                if (strcmp(curr->args[j], history_item->args[j]) != 0)
-                {
-                    match = 0;
-                }
-            }
-            if (match)
-            {
-                return index;
-            }
+            return curr;
         }
-        curr = curr->next;
-        index++;
+        curr = curr->line_next;
     }
+    return NULL;
+}
 
-    // Not found
-    return -1;
+// Helper Method: Unlink HistoryItem from exact line table
+void history_unlink_line(History *history, HistoryItem *item)
+{
+    HistoryItem **link = &history->line_table[hash_string(item->line) & (history->line_slots - 1)];
+    while (*link != NULL && *link != item)
+    {
+        link = &(*link)->line_next;
+    }
+    if (*link != NULL)
+    {
+        *link = item->line_next;
+    }
 }
 
-// Helper Method: Add HistoryItem to History LinkedList
-void add_history_item(History *history, HistoryItem *history_item)
+// Helper Method: Grow exact line table once it holds more items than slots
+int history_grow_lines(History *history)
 {
-    int in_history = history_contains(history, history_item);
+    int slots = history->line_slots ? history->line_slots * 2 : 64;
+    HistoryItem **table = calloc(slots, sizeof(HistoryItem *));
+    if (table == NULL)
+    {
+        return 0;
+    }
+    for (HistoryItem *curr = history->head; curr != NULL; curr = curr->next)
+    {
+        unsigned int slot = hash_string(curr->line) & (slots - 1);
+        curr->line_next = table[slot];
+        table[slot] = curr;
+    }
+    free(history->line_table);
+    history->line_table = table;
+    history->line_slots = slots;
+    return 1;
+}
 
-    // Item in history and is infront, no change
-    if (in_history >= 0)
+// Helper Method: Find posting list for trigram (creating it if asked)
+TrigramPosting *history_posting(History *history, unsigned int trigram, int create)
+{
+    if (history->posting_slots == 0)
     {
-        return;
+        return NULL;
     }
-    // Item not in history, add to the front, handle size
-    else
+    unsigned int mask = history->posting_slots - 1;
+    unsigned int slot = (trigram * 2654435761u) & mask;
+    while (history->postings[slot].trigram != 0)
     {
-        // Size stays in bounds
-        if (history->size < history->max)
+        if (history->postings[slot].trigram == trigram)
         {
-            history_item->next = history->head;
-            history->head = history_item;
-            history->size++;
+            return &history->postings[slot];
         }
-        // History is full, add new item to front and remove last
-        else
-        {
-            history_item->next = history->head;
-            history->head = history_item;
-
-            // Find second last item
-            HistoryItem *currItem = history->head;
-            for (int i = 0; i < history->size - 1; i++)
-            {
-                currItem = currItem->next;
-            }
+        slot = (slot + 1) & mask;
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+    history->postings[slot].trigram = trigram;
+    history->posting_used++;
+    return &history->postings[slot];
+}
 
-            // Free last item
-            free(currItem->next->args);
-            free(currItem->next);
-            currItem->next = NULL;
+// Helper Method: Grow trigram table, keeping it at most half full
+int history_grow_postings(History *history)
+{
+    TrigramPosting *old = history->postings;
+    int old_slots = history->posting_slots;
+    int slots = old_slots ? old_slots * 2 : 4096;
+    history->postings = calloc(slots, sizeof(TrigramPosting));
+    if (history->postings == NULL)
+    {
+        history->postings = old;
+        return 0;
+    }
+    history->posting_slots = slots;
+    history->posting_used = 0;
+    for (int i = 0; i < old_slots; i++)
+    {
+        if (old[i].trigram != 0)
+        {
+            *history_posting(history, old[i].trigram, 1) = old[i];
         }
     }
+    free(old);
+    return 1;
 }
 
-// Helper Method: Adjust history size
-void set_history_size(History *history, int new_size)
+// Helper Method: Trigram of three bytes starting at str
+unsigned int history_trigram(const char *str)
+{
+    return ((unsigned int)(unsigned char)str[0] << 16) | ((unsigned int)(unsigned char)str[1] << 8) | (unsigned char)str[2];
+}
+
+// Helper Method: Append item to the posting list of every trigram in its line
+int history_index_item(History *history, HistoryItem *item)
 {
-    // Decreasing size
-    if (history->max > new_size)
+    size_t len = strlen(item->line);
+    for (size_t i = 0; i + 3 <= len; i++)
     {
-        // Remove items with index greater than new_size
-        if (history->size > new_size)
+        if (history->posting_used * 2 >= history->posting_slots && !history_grow_postings(history))
+        {
+            return 0;
+        }
+        TrigramPosting *posting = history_posting(history, history_trigram(item->line + i), 1);
+
+        // Repeated trigram in the same line, already the newest entry
+        if (posting->count > 0 && posting->items[posting->start + posting->count - 1] == item)
         {
-            HistoryItem *curr = history->head;
-            for (int i = 0; i < new_size - 1; i++)
+            continue;
+        }
+        if (posting->start + posting->count == posting->cap)
+        {
+            if (posting->start > 0)
             {
-                curr = curr->next;
+                // Reuse space freed by evicted items
+                memmove(posting->items, posting->items + posting->start, sizeof(HistoryItem *) * posting->count);
+                posting->start = 0;
             }
-
-            // Free remaining
-            HistoryItem *to_free = curr->next;
-            curr->next = NULL;
-            while (to_free != NULL)
+            else
             {
-                HistoryItem *next = to_free->next;
-                free(to_free->args);
-                free(to_free);
-                to_free = next;
+                int cap = posting->cap ? posting->cap * 2 : 4;
+                HistoryItem **grown = realloc(posting->items, sizeof(HistoryItem *) * cap);
+                if (grown == NULL)
+                {
+                    return 0;
+                }
+                posting->items = grown;
+                posting->cap = cap;
             }
-
-            history->size = new_size;
         }
-        history->max = new_size;
-    }
-    // Increasing size
-    else
-    {
-        history->max = new_size;
+        posting->items[posting->start + posting->count++] = item;
     }
+    return 1;
 }
 
-// Helper Method: Free history data
-void free_history(History *history)
+// Helper Method: Remove oldest item from its posting lists (always their first entry)
+void history_unindex_item(History *history, HistoryItem *item)
 {
-    HistoryItem *current = history->head;
-    HistoryItem *next_item;
-
-    // Loop each HistoryItem
-    while (current != NULL)
+    size_t len = strlen(item->line);
+    for (size_t i = 0; i + 3 <= len; i++)
     {
-        next_item = current->next;
-
-        for (int i = 0; i < current->arg_count; i++)
+        TrigramPosting *posting = history_posting(history, history_trigram(item->line + i), 0);
+        if (posting != NULL && posting->count > 0 && posting->items[posting->start] == item)
         {
-            free(current->args[i]);
+            posting->start++;
+            posting->count--;
+            if (posting->count == 0)
+            {
+                posting->start = 0;
+            }
         }
-
-        free(current->args);
-        free(current);
-        current = next_item;
     }
-    history->head = NULL;
-    history->size = 0;
-    free(history);
 }
 
-// Helper Method: identify pointer to value corresponding to variable if any
-char *replace_var(char *token, LocalVariableList *local)
+// Helper Method: Unlink HistoryItem from the recently reused list
+void history_unlink_recent(History *history, HistoryItem *item)
 {
-    // Check environment vars first
-    char *env_val = getenv(token);
-    if (env_val != NULL)
+    if (item->recent_prev != NULL)
     {
-        return env_val;
+        item->recent_prev->recent_next = item->recent_next;
     }
-
-    // Not found, check local
-    LocalVariable *curr = local->head;
-    while (curr != NULL)
+    else if (history->recent == item)
     {
-        if (strcmp(token, curr->var) == 0)
-        {
-            return curr->val;
-        }
-        curr = curr->next;
+        history->recent = item->recent_next;
     }
-
-    // No variable found, return empty string
-    char *empty = "";
-    return empty;
-}
-
-void built_in_exit(LocalVariableList *local, History *history, int prev_rc, FILE *file)
-{
-    // Free memory first
-    free_local_variables(local);
-    free_history(history);
-    if (file != NULL)
+    if (item->recent_next != NULL)
     {
-        fclose(file);
+        item->recent_next->recent_prev = item->recent_prev;
     }
-    exit(prev_rc);
+    item->recent_next = NULL;
+    item->recent_prev = NULL;
 }
 
-// https://www.geeksforgeeks.org/chdir-in-c-language-with-examples/
-int built_in_cd(char **args, int arg_count)
+// Helper Method: Remove and free the oldest HistoryItem
+void history_drop_oldest(History *history)
 {
-    // Ensure argument validity
-    if (arg_count == 2)
+    HistoryItem *oldest = history->tail;
+    if (oldest == NULL)
     {
-        // Change with argument
-        if (chdir(args[1]) != 0)
-        {
-            fprintf(stderr, "Error: cd could not access %s\n", args[1]);
-            return 1;
-        }
+        return;
+    }
+    history->tail = oldest->prev;
+    if (history->tail != NULL)
+    {
+        history->tail->next = NULL;
     }
     else
     {
-        fprintf(stderr, "Error: Invalid cd arguments\n");
-        return 1;
+        history->head = NULL;
     }
-    return 0;
+    history_unlink_line(history, oldest);
+    history_unlink_recent(history, oldest);
+    history_unindex_item(history, oldest);
+    free_history_item(oldest);
+    history->size--;
 }
 
-// https://man7.org/linux/man-pages/man3/getenv.3.html
-int built_in_export(char **args, int arg_count)
+// Helper Method: Add HistoryItem to History LinkedList (takes ownership of history_item)
+void add_history_item(History *history, HistoryItem *history_item)
 {
-    // Ensure argument validity
-    if (arg_count == 2)
-    {
-        // Seperate/tokenize argument
-        char *var = strtok(args[1], "=");
-        char *value = strtok(NULL, "=");
+    history->clock++;
+    HistoryItem *existing = history_lookup(history, history_item->line);
 
-        // Ensure proper argument
-        if (!var || !value)
+    // Item in history, keep its place but count the use for ranking
+    if (existing != NULL)
+    {
+        existing->uses++;
+        existing->last_used = history->clock;
+        if (existing->uses > history->max_uses)
         {
-            fprintf(stderr, "Error: Invalid export var format\n");
-            return 1;
+            history->max_uses = existing->uses;
         }
-
-        // Check for empty string val --> clear variable
-        if (value[0] == '"' && value[1] == '"' && value[2] == '\0')
+        // Move to front of recently reused list
+        history_unlink_recent(history, existing);
+        existing->recent_next = history->recent;
+        if (history->recent != NULL)
         {
-            char *empty = "";
-            value = empty;
-        }
-            
-        // Ensure set works
-        if (setenv(var, value, 1) != 0)
-        {
-            fprintf(stderr, "Error: Could not add/changing env var\n");
-            return 1;
+            history->recent->recent_prev = existing;
         }
+        history->recent = existing;
+        free_history_item(history_item);
+        return;
+    }
+
+    // Item not in history, add to the front, handle size
+    if (history->size >= history->line_slots && !history_grow_lines(history))
+    {
+        free_history_item(history_item);
+        return;
+    }
+    history_item->id = ++history->next_id;
+    history_item->uses = 1;
+    history_item->last_used = history->clock;
+    history_item->prev = NULL;
+    history_item->next = history->head;
+    if (history->head != NULL)
+    {
+        history->head->prev = history_item;
     }
     else
     {
-        fprintf(stderr, "Error: Invalid export arguments\n");
-        return 1;
+        history->tail = history_item;
     }
-    return 0;
-}
+    history->head = history_item;
+    history->size++;
 
-int built_in_local(char **args, int arg_count, LocalVariableList *local)
-{
-    // Ensure argument validity
-    if (arg_count == 2)
+    unsigned int slot = hash_string(history_item->line) & (history->line_slots - 1);
+    history_item->line_next = history->line_table[slot];
+    history->line_table[slot] = history_item;
+    if (!history_index_item(history, history_item))
     {
-        if (args[1] == NULL || strlen(args[1]) < 2)
-        {
-            fprintf(stderr, "Error: Invalid local format\n");
-            return 1;
-        }
-
-        // Seperate/tokenize argument
-        char *var = strtok(args[1], "=");
-        char *val = strtok(NULL, "=");
-
-        // Ensure proper argument
-        if (!var)
-        {
-            fprintf(stderr, "Error: Invalid local var format\n");
-            return 1;
-        }
+        fprintf(stderr, "Error: Could not index history item\n");
+    }
 
-        // Check for empty string val --> clear variable
-        if (!val || val[0] == '\0')
-        {
-            // Replace existing variable
-            LocalVariable *curr = local->head;
-            while (curr != NULL)
-            {
-                if (strcmp(curr->var, var) == 0)
-                {
-                    char *empty = "";
-                    curr->val = empty;
-                    return 0;
-                }
-                curr = curr->next;
-            }
+    // History is full, remove last
+    while (history->size > history->max)
+    {
+        history_drop_oldest(history);
+    }
+}
 
-            fprintf(stderr, "Error: cannot clear local var that does not exist\n");
-            return 1;
-        }
-        // Not clearing, changing or creating variable
-        else
-        {
-            // Check for val variable replacement
-            if (val[0] == '$')
-            {
-                val = replace_var(val + 1, local);
-            }
+// Helper Method: Adjust history size
+void set_history_size(History *history, int new_size)
+{
+    // Remove oldest items beyond new_size
+    history->max = new_size;
+    while (history->size > new_size)
+    {
+        history_drop_oldest(history);
+    }
+}
 
-            // Check if var already exists
-            // Replace existing variable
-            LocalVariable *curr = local->head;
-            while (curr != NULL)
-            {
-                if (strcmp(curr->var, var) == 0)
-                {
-                    curr->val = strdup(val);
-                    if (curr->val == NULL)
-                    {
-                        fprintf(stderr, "Error: duplicating value string\n");
-                        return 1;
-                    }
-                    return 0;
-                }
-                curr = curr->next;
-            }
+// Helper Method: Free history data
+void free_history(History *history)
+{
+    HistoryItem *current = history->head;
+    HistoryItem *next_item;
 
-            // Var does not exist, add new
-            if (!add_local_variable(var, val, local))
-            {
-                fprintf(stderr, "Error: duplicating for new local\n");
-                return 1;
-            }
-            return 1;
-        }
+    // Loop each HistoryItem
+    while (current != NULL)
+    {
+        next_item = current->next;
+        free_history_item(current);
+        current = next_item;
     }
-    else
+    for (int i = 0; i < history->posting_slots; i++)
     {
-        fprintf(stderr, "Error: Invalid local arguments\n");
-        return 1;
+        free(history->postings[i].items);
     }
-    return 0;
+    free(history->postings);
+    free(history->line_table);
+    history->head = NULL;
+    history->tail = NULL;
+    history->size = 0;
+    free(history);
 }
 
-int built_in_vars(int arg_count, LocalVariableList *local)
+// Helper Method: get HistoryItem by index (1 is most recent)
+HistoryItem *history_item_at(History *history, int index)
 {
-    if (arg_count == 1)
+    HistoryItem *curr = history->head;
+    for (int i = 1; i < index && curr != NULL; i++)
     {
-        LocalVariable *curr = local->head;
-        while (curr != NULL)
+        curr = curr->next;
+    }
+    return index >= 1 ? curr : NULL;
+}
+
+// Helper Method: index of a HistoryItem as shown by history (ids are contiguous)
+long long history_item_index(History *history, HistoryItem *item)
+{
+    return history->head->id - item->id + 1;
+}
+
+// Helper Method: rank of a HistoryItem, use count decaying with commands since last use
+double history_score(History *history, HistoryItem *item)
+{
+    return item->uses / (1.0 + (history->clock - item->last_used) / HISTORY_RECENCY_SCALE);
+}
+
+// Helper Method: keep results[0..count) ordered best first, inserting item if it ranks
+int history_rank_insert(History *history, HistoryItem **results, int count, int limit, HistoryItem *item)
+{
+    double score = history_score(history, item);
+    int at = count;
+    while (at > 0)
+    {
+        HistoryItem *other = results[at - 1];
+        double other_score = history_score(history, other);
+        if (other_score > score || (other_score == score && other->id > item->id))
         {
-            printf("%s=%s\n", curr->var, curr->val);
-            curr = curr->next;
+            break;
         }
+        at--;
     }
-    else
+    if (at >= limit)
     {
-        fprintf(stderr, "Error: Invalid vars arguments\n");
-        return 1;
+        return count;
     }
-    return 0;
+    if (count == limit)
+    {
+        count--;
+    }
+    memmove(results + at + 1, results + at, sizeof(HistoryItem *) * (count - at));
+    results[at] = item;
+    return count + 1;
 }
 
-int built_in_history(char **args, int arg_count, Redirect *redirect, LocalVariableList *local, History *history, int prev_rc, FILE *file)
+// Helper Method: find history lines containing pattern, best ranked first
+// Reused lines are checked first, then single-use lines newest first until none can rank
+int history_search(History *history, const char *pattern, HistoryItem **results, int limit)
 {
-    // Show History List
-    if (arg_count == 1)
+    int count = 0;
+    size_t len = strlen(pattern);
+    if (len == 0 || limit <= 0)
     {
-        // Print History
-        HistoryItem *curr_item = history->head;
-        int index = 1;
-        while (curr_item != NULL)
-        {
-            printf("%i)", index);
-            for (int j = 0; j < curr_item->arg_count; j++)
-            {
-                printf(" %s", curr_item->args[j]);
-            }
-            printf("\n");
-
-            curr_item = curr_item->next;
-            index++;
-        }
+        return 0;
     }
-    // Use command from history
-    else if (arg_count == 2)
-    {
-        int index = atoi(args[1]);
 
-        // Check if index is within bounds
-        if (index > 0 && index <= history->size)
+    // Reused lines, most recently used first, bounded by the highest use count
+    for (HistoryItem *curr = history->recent; curr != NULL; curr = curr->recent_next)
+    {
+        double bound = history->max_uses / (1.0 + (history->clock - curr->last_used) / HISTORY_RECENCY_SCALE);
+        if (count == limit && bound < history_score(history, results[limit - 1]))
         {
-            HistoryItem *curr_item = history->head;
-
-            // Get item at index
-            for (int i = 1; i < index; i++)
-            {
-                curr_item = curr_item->next;
-            }
-
-            // Execute the command stored in the history item
-            handle_command(curr_item->args, curr_item->arg_count, redirect, local, history, prev_rc, file);
+            break;
         }
-        else
+        if (strstr(curr->line, pattern) != NULL)
         {
-            fprintf(stderr, "Error: History index out of bounds\n");
-            return 1;
+            count = history_rank_insert(history, results, count, limit, curr);
         }
     }
-    // Change history size
-    else if (arg_count == 3)
+
+    // Only lines in the shortest posting list of the pattern's trigrams can match
+    // (short patterns have no trigram and walk the whole list)
+    TrigramPosting *best = NULL;
+    for (size_t i = 0; i + 3 <= len; i++)
     {
-        int new_size = atoi(args[2]);
-        char *set = "set";
-        if (strcmp(set, args[1]) == 0)
+        TrigramPosting *posting = history_posting(history, history_trigram(pattern + i), 0);
+        if (posting == NULL || posting->count == 0)
         {
-            if (new_size >= 1 && new_size <= 50)
-            {
-                // Adjust history size
-                set_history_size(history, new_size);
-            }
-            else
-            {
-                fprintf(stderr, "Error: Command history size out of bounds: [1, 50]\n");
-                return 1;
-            }
+            return count;
         }
-        else
+        if (best == NULL || posting->count < best->count)
         {
-            fprintf(stderr, "Error: Improper history usage\n");
-            return 1;
+            best = posting;
         }
     }
-    else
-    {
-        fprintf(stderr, "Error: Improper history usage\n");
-        return 1;
-    }
-    return 0;
-}
-
-// https://man7.org/linux/man-pages/man3/scandir.3.html
-int built_in_ls(int arg_count)
-{
-    // Ensure usage
-    if (arg_count == 1)
+    HistoryItem *curr = best ? NULL : history->head;
+    int i = best ? best->start + best->count - 1 : 0;
+    while (best ? i >= best->start : curr != NULL)
     {
-        // Get elements
-        char *shell_path = ".";
-        // char *shell_path = getenv("PATH");
-        struct dirent **fileList;
-        int num_files = scandir(shell_path, &fileList, NULL, alphasort);
-        // Print elements (not . or .. which should be sorted to front)
-        for (int i = 2; i < num_files; i++)
+        HistoryItem *item = best ? best->items[i--] : curr;
+        curr = best ? NULL : curr->next;
+        if (item->uses > 1)
         {
-            // Ignoring hidden files like gitignore
-            if (fileList[i]->d_name[0] != '.')
-            {
-                printf("%s\n", fileList[i]->d_name);
-            }
+            continue;
         }
-
-        // Free memory
-        for (int i = 0; i < num_files; i++)
+        // Single-use scores only fall from here on
+        if (count == limit && history_score(history, item) <= history_score(history, results[limit - 1]))
+        {
+            break;
+        }
+        if (strstr(item->line, pattern) != NULL)
         {
-            free(fileList[i]);
+            count = history_rank_insert(history, results, count, limit, item);
         }
-        free(fileList);
     }
-    else
+    return count;
+}
+
+// Helper Method: identify pointer to value corresponding to variable if any
+char *replace_var(char *token, LocalVariableList *local)
+{
+    // Exported and local variables share one store
+    char *val = get_variable(local, token);
+    if (val != NULL)
     {
-        fprintf(stderr, "Error: Invalid ls command arguments!\n");
-        return 1;
+        return val;
     }
-    return 0;
+
+    // No variable found, return empty string
+    char *empty = "";
+    return empty;
 }
 
-void crop_redirect(char **args, int *arg_count)
+// Helper Method: compare two strings for qsort
+int compare_strings(const void *a, const void *b)
 {
-    args[*arg_count - 1] = NULL;
-    (*arg_count)--;
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-void restore_fd_free_redirect(Redirect *redirect, int in_d, int out_d, int err_d)
+// Helper Method: free a directory listing
+void free_dir_listing(DirListing *listing)
 {
-    if (redirect != NULL && !redirect->redirect_type)
+    if (listing == NULL)
     {
-        dup2(in_d, STDIN_FILENO);
-        dup2(out_d, STDOUT_FILENO);
-        dup2(err_d, STDERR_FILENO);
-
-        close(in_d);
-        close(out_d);
-        close(err_d);
+        return;
     }
+    free(listing->path);
+    free(listing->names);
+    free(listing->types);
+    free(listing->arena);
+    free(listing);
 }
 
-int handle_command(char **args, int arg_count, Redirect *redirect, LocalVariableList *local, History *history, int prev_rc, FILE *file)
+// Helper Method: read all entries of a directory (except . and ..), sorted
+// Names are packed into a single arena so huge directories cost two allocations per growth step
+DirListing *read_dir_listing(const char *path)
 {
-    int fd;
-    int in_d = dup(STDIN_FILENO);
-    int out_d = dup(STDOUT_FILENO);
-    int err_d = dup(STDERR_FILENO);
-    switch(redirect->redirect_type)
+    DIR *dir = opendir(path);
+    if (dir == NULL)
     {
-        case NR: {
-            // No Redirecting
-            break;
-        }
-        case RI: {
-            // Get sign pointer
-            char *arg_copy = strdup(redirect->last_arg);
-            if (arg_copy == NULL)
-            {
-                return 1;
-            }
-            char *sign = strchr(arg_copy, '<');
+        return NULL;
+    }
 
-            // Get file pointer
-            char *file_name = sign + 1;
+    DirListing *listing = calloc(1, sizeof(DirListing));
+    if (listing == NULL)
+    {
+        closedir(dir);
+        return NULL;
+    }
+    listing->path = strdup(path);
 
-            // Attempt to find an n
-            int new_fd = STDIN_FILENO;
+    size_t arena_len = 0;
+    size_t arena_cap = 4096;
+    size_t *offsets = NULL;
+    int cap = 0;
+    listing->arena = malloc(arena_cap);
+    if (listing->path == NULL || listing->arena == NULL)
+    {
+        closedir(dir);
+        free_dir_listing(listing);
+        return NULL;
+    }
 
-            if (sign != NULL)
+    // Copy names into the arena, remembering offsets (arena may move while growing)
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        size_t len = strlen(entry->d_name) + 1;
+        if (arena_len + len > arena_cap)
+        {
+            while (arena_len + len > arena_cap)
             {
-                *sign = '\0';
-                int parse = atoi(arg_copy);
-                if (parse != 0)
-                {
-                    new_fd = parse;
-                }
+                arena_cap *= 2;
             }
-
-            // Access
-            fd = open(file_name, O_RDONLY);
-            if (dup2(fd, new_fd) == -1)
+            char *grown = realloc(listing->arena, arena_cap);
+            if (grown == NULL)
             {
-                fprintf(stderr, "Error: could not change fd\n");
-                close(fd);
-                return 1;
+                closedir(dir);
+                free(offsets);
+                free_dir_listing(listing);
+                return NULL;
             }
-            close(fd);
-            break;
+            listing->arena = grown;
         }
-        case RO: {
-            // Get sign pointer
-            char *arg_copy = strdup(redirect->last_arg);
-            if (arg_copy == NULL)
+        if (listing->count == cap)
+        {
+            cap = cap ? cap * 2 : 256;
+            size_t *grown_offsets = realloc(offsets, sizeof(size_t) * cap);
+            unsigned char *grown_types = realloc(listing->types, cap);
+            if (grown_offsets == NULL || grown_types == NULL)
             {
-                return 1;
+                closedir(dir);
+                free(grown_offsets ? grown_offsets : offsets);
+                listing->types = grown_types ? grown_types : listing->types;
+                free_dir_listing(listing);
+                return NULL;
             }
-            char *sign = strchr(arg_copy, '>');
+            offsets = grown_offsets;
+            listing->types = grown_types;
+        }
+        memcpy(listing->arena + arena_len, entry->d_name, len);
+        offsets[listing->count] = arena_len;
+        listing->types[listing->count] = entry->d_type;
+        listing->count++;
+        arena_len += len;
+    }
+    closedir(dir);
 
-            // Get file pointer
-            char *file_name = sign + 1;
+    // Build name pointers now that the arena is final
+    listing->names = malloc(sizeof(char *) * (listing->count + 1));
+    if (listing->names == NULL)
+    {
+        free(offsets);
+        free_dir_listing(listing);
+        return NULL;
+    }
+    for (int i = 0; i < listing->count; i++)
+    {
+        listing->names[i] = listing->arena + offsets[i];
+    }
+    free(offsets);
 
-            // Attempt to find an n
-            int new_fd = STDOUT_FILENO;
-            if (sign != NULL)
+    // Sort names, carrying types along through an index permutation
+    if (listing->count > 1)
+    {
+        unsigned char *sorted_types = malloc(listing->count);
+        char **by_name = malloc(sizeof(char *) * listing->count);
+        if (sorted_types == NULL || by_name == NULL)
+        {
+            free(sorted_types);
+            free(by_name);
+            free_dir_listing(listing);
+            return NULL;
+        }
+        memcpy(by_name, listing->names, sizeof(char *) * listing->count);
+        qsort(listing->names, listing->count, sizeof(char *), compare_strings);
+        // Original arena order is increasing, so binary search recovers each type
+        for (int i = 0; i < listing->count; i++)
+        {
+            int lo = 0;
+            int hi = listing->count - 1;
+            while (lo < hi)
             {
-                *sign = '\0';
-                int parse = atoi(arg_copy);
-                if (parse != 0)
+                int mid = lo + (hi - lo) / 2;
+                if (by_name[mid] < listing->names[i])
                 {
-                    new_fd = parse;
+                    lo = mid + 1;
+                }
+                else
+                {
+                    hi = mid;
                 }
             }
+            sorted_types[i] = listing->types[lo];
+        }
+        free(by_name);
+        free(listing->types);
+        listing->types = sorted_types;
+    }
+    listing->names[listing->count] = NULL;
+    return listing;
+}
 
-            // Access
-            fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+// Helper Method: get listing from cache, reading directory on first use
+DirListing *get_dir_listing(DirCache *cache, const char *path)
+{
+    unsigned int bucket = hash_string(path) % DIRCACHE_BUCKETS;
+    DirListing *curr = cache->buckets[bucket];
+    while (curr != NULL)
+    {
+        if (strcmp(curr->path, path) == 0)
+        {
+            return curr;
+        }
+        curr = curr->next;
+    }
 
-            if (fd == -1)
-            {
-                fprintf(stderr, "Error: could not open file\n");
-                return 1;
-            }
-            if (dup2(fd, new_fd) == -1)
-            {
-                fprintf(stderr, "Error: could not change fd\n");
-                close(fd);
-                return 1;
-            }
-            close(fd);
-            break;
+    DirListing *listing = read_dir_listing(path);
+    if (listing == NULL)
+    {
+        return NULL;
+    }
+    listing->next = cache->buckets[bucket];
+    cache->buckets[bucket] = listing;
+    return listing;
+}
+
+// Helper Method: free all cached listings
+void free_dir_cache(DirCache *cache)
+{
+    for (int i = 0; i < DIRCACHE_BUCKETS; i++)
+    {
+        DirListing *curr = cache->buckets[i];
+        while (curr != NULL)
+        {
+            DirListing *next = curr->next;
+            free_dir_listing(curr);
+            curr = next;
         }
-        case ARO: {
-            // Get sign pointer
-            char *arg_copy = strdup(redirect->last_arg);
-            if (arg_copy == NULL)
-            {
-                return 1;
-            }
-            char *sign = strchr(arg_copy, '>');
+        cache->buckets[i] = NULL;
+    }
+}
 
-            // Get file pointer
-            char *file_name = sign + 2;
+// Helper Method: check if string has unescaped glob characters
+int has_glob_chars(const char *str)
+{
+    for (; *str; str++)
+    {
+        if (*str == '\\' && str[1] != '\0')
+        {
+            str++;
+        }
+        else if (*str == '*' || *str == '?' || *str == '[')
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-            // Attempt to find an n
-            int new_fd = STDOUT_FILENO;
-            if (sign != NULL)
+// Helper Method: match one character against a [...] class, sets *end past the class
+// Returns -1 if the class is unterminated (then '[' is a literal)
+int match_glob_class(const char *pattern, char c, const char **end)
+{
+    const char *p = pattern + 1;
+    int negate = 0;
+    int matched = 0;
+    if (*p == '!' || *p == '^')
+    {
+        negate = 1;
+        p++;
+    }
+    // A leading ']' is part of the set
+    int first = 1;
+    while (*p != '\0' && (*p != ']' || first))
+    {
+        first = 0;
+        char low = *p;
+        if (low == '\\' && p[1] != '\0')
+        {
+            low = *++p;
+        }
+        char high = low;
+        if (p[1] == '-' && p[2] != ']' && p[2] != '\0')
+        {
+            high = p[2];
+            if (high == '\\' && p[3] != '\0')
             {
-                *sign = '\0';
-                int parse = atoi(arg_copy);
-                if (parse != 0)
-                {
-                    new_fd = parse;
-                }
+                high = p[3];
+                p++;
             }
+            p += 2;
+        }
+        if ((unsigned char)c >= (unsigned char)low && (unsigned char)c <= (unsigned char)high)
+        {
+            matched = 1;
+        }
+        p++;
+    }
+    if (*p != ']')
+    {
+        return -1;
+    }
+    *end = p + 1;
+    return matched != negate;
+}
 
-            // Access
-            fd = open(file_name, O_WRONLY | O_CREAT | O_APPEND, 0644);
-            if (fd == -1)
-            {
-                fprintf(stderr, "Error: could not open file\n");
-                return 1;
-            }
-            if (dup2(fd, new_fd) == -1)
+// Helper Method: match a single path segment against a glob pattern
+// Only the most recent '*' is ever revisited, so time is O(len(pattern) * len(name)) worst case
+int glob_match(const char *pattern, const char *name)
+{
+    const char *p = pattern;
+    const char *n = name;
+    const char *star_p = NULL;
+    const char *star_n = NULL;
+
+    // Leading dots only match explicitly
+    if (*n == '.' && *p != '.')
+    {
+        return 0;
+    }
+
+    while (*n != '\0')
+    {
+        if (*p == '*')
+        {
+            while (*p == '*')
             {
-                fprintf(stderr, "Error: could not change fd\n");
-                close(fd);
-                return 1;
+                p++;
             }
-            close(fd);
-            break;
+            star_p = p;
+            star_n = n;
+            continue;
         }
-        case RSOSE: {
-            // Get sign pointer
-            char *arg_copy = strdup(redirect->last_arg);
-            if (arg_copy == NULL)
+
+        const char *next = p + 1;
+        int matched = 0;
+        if (*p == '?')
+        {
+            matched = 1;
+        }
+        else if (*p == '[')
+        {
+            int class_rc = match_glob_class(p, *n, &next);
+            matched = class_rc == -1 ? *n == '[' : class_rc;
+            if (class_rc == -1)
             {
-                return 1;
+                next = p + 1;
             }
-            char *sign = strchr(arg_copy, '&');
+        }
+        else if (*p == '\\' && p[1] != '\0')
+        {
+            matched = p[1] == *n;
+            next = p + 2;
+        }
+        else
+        {
+            matched = *p != '\0' && *p == *n;
+        }
 
-            // Get file pointer
-            char *file_name = sign + 2;
+        if (matched)
+        {
+            p = next;
+            n++;
+        }
+        else if (star_p != NULL)
+        {
+            // Let the last '*' absorb one more character
+            p = star_p;
+            n = ++star_n;
+        }
+        else
+        {
+            return 0;
+        }
+    }
 
-            // Access
-            fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd == -1)
-            {
-                fprintf(stderr, "Error: could not open file\n");
-                return 1;
-            }
-            if (dup2(fd, STDOUT_FILENO) == -1 || dup2(fd, STDERR_FILENO) == -1)
+    while (*p == '*')
+    {
+        p++;
+    }
+    return *p == '\0';
+}
+
+// Helper Method: append a path to glob matches
+int add_glob_match(GlobMatches *matches, const char *path)
+{
+    if (matches->count == matches->cap)
+    {
+        int cap = matches->cap ? matches->cap * 2 : 16;
+        char **grown = realloc(matches->paths, sizeof(char *) * cap);
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        matches->paths = grown;
+        matches->cap = cap;
+    }
+    matches->paths[matches->count] = strdup(path);
+    if (matches->paths[matches->count] == NULL)
+    {
+        return 0;
+    }
+    matches->count++;
+    return 1;
+}
+
+// Helper Method: free glob matches
+void free_glob_matches(GlobMatches *matches)
+{
+    for (int i = 0; i < matches->count; i++)
+    {
+        free(matches->paths[i]);
+    }
+    free(matches->paths);
+    matches->paths = NULL;
+    matches->count = 0;
+    matches->cap = 0;
+}
+
+// Helper Method: join directory prefix and entry name into buffer
+char *join_glob_path(const char *prefix, const char *name)
+{
+    size_t prefix_len = strlen(prefix);
+    char *joined = malloc(prefix_len + strlen(name) + 2);
+    if (joined == NULL)
+    {
+        return NULL;
+    }
+    strcpy(joined, prefix);
+    if (prefix_len > 0 && prefix[prefix_len - 1] != '/')
+    {
+        strcat(joined, "/");
+    }
+    strcat(joined, name);
+    return joined;
+}
+
+// Helper Method: check if a listing entry is a directory
+int glob_entry_is_dir(const char *path, unsigned char type)
+{
+    if (type == DT_DIR)
+    {
+        return 1;
+    }
+    if (type != DT_UNKNOWN && type != DT_LNK)
+    {
+        return 0;
+    }
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Helper Method: expand segments[index..] below prefix into matches
+int expand_glob_segments(const char *prefix, char **segments, int index, int seg_count, DirCache *cache, GlobMatches *matches)
+{
+    // All segments consumed, prefix is a match
+    if (index == seg_count)
+    {
+        return add_glob_match(matches, prefix);
+    }
+
+    char *segment = segments[index];
+    int last = index == seg_count - 1;
+
+    // Literal segment, no directory read needed
+    if (!has_glob_chars(segment))
+    {
+        char *path = join_glob_path(prefix, segment);
+        if (path == NULL)
+        {
+            return 0;
+        }
+        struct stat st;
+        int rc = 1;
+        if (lstat(path, &st) == 0 && (last || S_ISDIR(st.st_mode) || stat(path, &st) == 0))
+        {
+            rc = expand_glob_segments(path, segments, index + 1, seg_count, cache, matches);
+        }
+        free(path);
+        return rc;
+    }
+
+    DirListing *listing = get_dir_listing(cache, prefix[0] == '\0' ? "." : prefix);
+    if (listing == NULL)
+    {
+        return 1;
+    }
+
+    // '**' matches zero or more directories, as the last segment every entry below prefix
+    if (strcmp(segment, "**") == 0)
+    {
+        if (!last && !expand_glob_segments(prefix, segments, index + 1, seg_count, cache, matches))
+        {
+            return 0;
+        }
+        for (int i = 0; i < listing->count; i++)
+        {
+            if (listing->names[i][0] == '.' || listing->types[i] == DT_LNK)
             {
-                fprintf(stderr, "Error: could not change fd\n");
-                close(fd);
-                return 1;
+                continue;
             }
-            close(fd);
-            break;
-        }
-        case ASOSE: {
-            // Get sign pointer
-            char *arg_copy = strdup(redirect->last_arg);
-            if (arg_copy == NULL)
+            char *path = join_glob_path(prefix, listing->names[i]);
+            if (path == NULL)
             {
-                return 1;
+                return 0;
             }
-            char *sign = strchr(arg_copy, '&');
-
-            // Get file pointer
-            char *file_name = sign + 3;
-
-            // Access
-            fd = open(file_name, O_WRONLY | O_CREAT | O_APPEND, 0644);
-            if (fd == -1)
+            int rc = !last || add_glob_match(matches, path);
+            if (rc && glob_entry_is_dir(path, listing->types[i]))
             {
-                fprintf(stderr, "Error: could not open file\n");
-                return 1;
+                rc = expand_glob_segments(path, segments, index, seg_count, cache, matches);
             }
-            if (dup2(fd, STDOUT_FILENO) == -1 || dup2(fd, STDERR_FILENO) == -1)
+            free(path);
+            if (!rc)
             {
-                fprintf(stderr, "Error: could not change fd\n");
-                close(fd);
-                return 1;
+                return 0;
             }
-            close(fd);
-            break;
         }
-        default:
-            fprintf(stderr, "Error: handling redirects\n");
-            return 1;
+        return 1;
     }
 
-    // Remove redirect from args if it was present
-    if (redirect->redirect_type)
+    for (int i = 0; i < listing->count; i++)
     {
-        crop_redirect(args, &arg_count);
-    }
-
-    // Redirect complete now handle command
+        if (!glob_match(segment, listing->names[i]))
+        {
+            continue;
+        }
+        char *path = join_glob_path(prefix, listing->names[i]);
+        if (path == NULL)
+        {
+            return 0;
+        }
+        int rc = 1;
+        if (last || glob_entry_is_dir(path, listing->types[i]))
+        {
+            rc = expand_glob_segments(path, segments, index + 1, seg_count, cache, matches);
+        }
+        free(path);
+        if (!rc)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Helper Method: expand a glob pattern, appending sorted results to matches
+// Returns number of paths added (0 if nothing matched), -1 on allocation failure
+int expand_glob(const char *pattern, DirCache *cache, GlobMatches *matches)
+{
+    char *copy = strdup(pattern);
+    if (copy == NULL)
+    {
+        return -1;
+    }
+
+    // Split into segments on '/'
+    int seg_count = 0;
+    for (char *c = copy; *c; c++)
+    {
+        if (*c == '/')
+        {
+            seg_count++;
+        }
+    }
+    char **segments = malloc(sizeof(char *) * (seg_count + 1));
+    if (segments == NULL)
+    {
+        free(copy);
+        return -1;
+    }
+    seg_count = 0;
+    char *saveptr = NULL;
+    for (char *seg = strtok_r(copy, "/", &saveptr); seg != NULL; seg = strtok_r(NULL, "/", &saveptr))
+    {
+        segments[seg_count++] = seg;
+    }
+
+    int start = matches->count;
+    int ok = expand_glob_segments(pattern[0] == '/' ? "/" : "", segments, 0, seg_count, cache, matches);
+    free(segments);
+    free(copy);
+    if (!ok)
+    {
+        return -1;
+    }
+
+    qsort(matches->paths + start, matches->count - start, sizeof(char *), compare_strings);
+    return matches->count - start;
+}
+
+void built_in_exit(LocalVariableList *local, History *history, int prev_rc, FILE *file)
+{
+    if (options.profile.path != NULL)
+    {
+        profile_finish(&options.profile);
+    }
+    // A failing run leaves its last commands behind for the post mortem
+    if (prev_rc != 0)
+    {
+        fflush(stdout);
+        fflush(stderr);
+        trace_dump(&options.trace, STDERR_FILENO);
+    }
+    // Completed lines must be on disk before we go
+    if (options.journal.fd >= 0)
+    {
+        fdatasync(options.journal.fd);
+        close(options.journal.fd);
+    }
+    // Free memory first
+    free_local_variables(local);
+    free_history(history);
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    exit(prev_rc);
+}
+
+// https://www.geeksforgeeks.org/chdir-in-c-language-with-examples/
+int built_in_cd(char **args, int arg_count)
+{
+    // Ensure argument validity
+    if (arg_count == 2)
+    {
+        // Change with argument
+        if (chdir(args[1]) != 0)
+        {
+            fprintf(stderr, "Error: cd could not access %s\n", args[1]);
+            return 1;
+        }
+        // Cached relative redirect targets now name other files
+        options.files.cwd_generation++;
+    }
+    else
+    {
+        fprintf(stderr, "Error: Invalid cd arguments\n");
+        return 1;
+    }
+    return 0;
+}
+
+int built_in_export(char **args, int arg_count, LocalVariableList *local)
+{
+    // Ensure argument validity
+    if (arg_count == 2)
+    {
+        // Seperate/tokenize argument
+        char *var = strtok(args[1], "=");
+        char *value = strtok(NULL, "=");
+
+        // Ensure proper argument
+        if (!var || !value)
+        {
+            fprintf(stderr, "Error: Invalid export var format\n");
+            return 1;
+        }
+
+        // Check for empty string val --> clear variable
+        if (value[0] == '"' && value[1] == '"' && value[2] == '\0')
+        {
+            char *empty = "";
+            value = empty;
+        }
+
+        // Ensure set works (only this variable's envp entry is rebuilt)
+        if (!set_variable(local, var, value, 1))
+        {
+            fprintf(stderr, "Error: Could not add/changing env var\n");
+            return 1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Error: Invalid export arguments\n");
+        return 1;
+    }
+    return 0;
+}
+
+int built_in_local(char **args, int arg_count, LocalVariableList *local)
+{
+    // Ensure argument validity
+    if (arg_count == 2)
+    {
+        if (args[1] == NULL || strlen(args[1]) < 2)
+        {
+            fprintf(stderr, "Error: Invalid local format\n");
+            return 1;
+        }
+
+        // Seperate/tokenize argument
+        char *var = strtok(args[1], "=");
+        char *val = strtok(NULL, "=");
+
+        // Ensure proper argument
+        if (!var)
+        {
+            fprintf(stderr, "Error: Invalid local var format\n");
+            return 1;
+        }
+
+        // Check for empty string val --> clear variable
+        if (!val || val[0] == '\0')
+        {
+            // Replace existing variable
+            if (find_local_var(local, var) != NULL)
+            {
+                char *empty = "";
+                if (!set_variable(local, var, empty, 0))
+                {
+                    fprintf(stderr, "Error: duplicating value string\n");
+                    return 1;
+                }
+                return 0;
+            }
+
+            fprintf(stderr, "Error: cannot clear local var that does not exist\n");
+            return 1;
+        }
+        // Not clearing, changing or creating variable
+        else
+        {
+            // Check for val variable replacement
+            if (val[0] == '$')
+            {
+                val = replace_var(val + 1, local);
+            }
+
+            // Replace existing variable or add new
+            if (!set_variable(local, var, val, 0))
+            {
+                fprintf(stderr, "Error: duplicating for new local\n");
+                return 1;
+            }
+            return 0;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Error: Invalid local arguments\n");
+        return 1;
+    }
+    return 0;
+}
+
+int built_in_vars(int arg_count, LocalVariableList *local)
+{
+    if (arg_count == 1)
+    {
+        // Exported variables belong to the environment, not vars
+        LocalVariable *curr = local->head;
+        while (curr != NULL)
+        {
+            if (!curr->exported)
+            {
+                printf("%s=%s\n", curr->var, curr->val);
+            }
+            curr = curr->next;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Error: Invalid vars arguments\n");
+        return 1;
+    }
+    return 0;
+}
+
+int built_in_history(char **args, int arg_count, LocalVariableList *local, History *history, int prev_rc, FILE *file)
+{
+    // Show History List
+    if (arg_count == 1)
+    {
+        // Print History
+        HistoryItem *curr_item = history->head;
+        int index = 1;
+        while (curr_item != NULL)
+        {
+            printf("%i)", index);
+            for (int j = 0; j < curr_item->arg_count; j++)
+            {
+                printf(" %s", curr_item->args[j]);
+            }
+            printf("\n");
+
+            curr_item = curr_item->next;
+            index++;
+        }
+    }
+    // Use command from history
+    else if (arg_count == 2)
+    {
+        int index = atoi(args[1]);
+
+        // Check if index is within bounds
+        if (index > 0 && index <= history->size)
+        {
+            HistoryItem *curr_item = history->head;
+
+            // Get item at index
+            for (int i = 1; i < index; i++)
+            {
+                curr_item = curr_item->next;
+            }
+
+            // Execute the command stored in the history item (redirects of this line are already applied)
+            Redirect none = {NULL, NR, -1, NULL, 0};
+            return handle_command(curr_item->args, curr_item->arg_count, &none, local, history, prev_rc, file);
+        }
+        else
+        {
+            fprintf(stderr, "Error: History index out of bounds\n");
+            return 1;
+        }
+    }
+    // Search history, best matches first
+    else if (arg_count >= 3 && strcmp(args[1], "search") == 0)
+    {
+        char pattern[MAXLINE] = "";
+        for (int i = 2; i < arg_count; i++)
+        {
+            if (i > 2)
+            {
+                strncat(pattern, " ", sizeof(pattern) - strlen(pattern) - 1);
+            }
+            strncat(pattern, args[i], sizeof(pattern) - strlen(pattern) - 1);
+        }
+        HistoryItem *results[HISTORY_SEARCH_LIMIT];
+        int count = history_search(history, pattern, results, HISTORY_SEARCH_LIMIT);
+        for (int i = 0; i < count; i++)
+        {
+            printf("%lld) %s\n", history_item_index(history, results[i]), results[i]->line);
+        }
+        return count > 0 ? 0 : 1;
+    }
+    // Change history size
+    else if (arg_count == 3)
+    {
+        int new_size = atoi(args[2]);
+        char *set = "set";
+        if (strcmp(set, args[1]) == 0)
+        {
+            if (new_size >= 1 && new_size <= MAXHISTORY)
+            {
+                // Adjust history size
+                set_history_size(history, new_size);
+            }
+            else
+            {
+                fprintf(stderr, "Error: Command history size out of bounds: [1, %d]\n", MAXHISTORY);
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Error: Improper history usage\n");
+            return 1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Error: Improper history usage\n");
+        return 1;
+    }
+    return 0;
+}
+
+// https://man7.org/linux/man-pages/man3/readdir.3.html
+int built_in_ls(int arg_count)
+{
+    // Ensure usage
+    if (arg_count == 1)
+    {
+        // Get elements (same reader glob expansion uses)
+        DirListing *listing = read_dir_listing(".");
+        if (listing == NULL)
+        {
+            fprintf(stderr, "Error: ls could not read directory\n");
+            return 1;
+        }
+        for (int i = 0; i < listing->count; i++)
+        {
+            // Ignoring hidden files like gitignore
+            if (listing->names[i][0] != '.')
+            {
+                printf("%s\n", listing->names[i]);
+            }
+        }
+
+        // Free memory
+        free_dir_listing(listing);
+    }
+    else
+    {
+        fprintf(stderr, "Error: Invalid ls command arguments!\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Helper Method: parse DURATION (number with optional ms, s, m or h suffix, seconds by default)
+int parse_duration(const char *text, long long *ns)
+{
+    char *end;
+    double value = strtod(text, &end);
+    double scale = 1e9;
+    if (strcmp(end, "ms") == 0)
+    {
+        scale = 1e6;
+    }
+    else if (strcmp(end, "m") == 0)
+    {
+        scale = 60e9;
+    }
+    else if (strcmp(end, "h") == 0)
+    {
+        scale = 3600e9;
+    }
+    else if (strcmp(end, "") != 0 && strcmp(end, "s") != 0)
+    {
+        return -1;
+    }
+    if (end == text || value < 0 || value * scale > (double)LLONG_MAX)
+    {
+        return -1;
+    }
+    *ns = (long long)(value * scale);
+    return 0;
+}
+
+// Resource limits in LIMIT_* slot order: ulimit flag, rlimit resource, unit size in bytes and name
+static const struct
+{
+    char flag;
+    int resource;
+    rlim_t unit;
+    const char *name;
+} limit_table[LIMIT_COUNT] = {
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+};
+
+// Usage: timeout [-k DURATION] DURATION command [args...]
+int built_in_timeout(char **args, int arg_count, LocalVariableList *local, History *history, int prev_rc, FILE *file)
+{
+    int first = 1;
+    long long kill_after_ns = options.kill_after_ns;
+    if (arg_count > 2 && strcmp(args[1], "-k") == 0)
+    {
+        if (parse_duration(args[2], &kill_after_ns) == -1)
+        {
+            fprintf(stderr, "Error: invalid timeout duration %s\n", args[2]);
+            return 1;
+        }
+        first = 3;
+    }
+    long long timeout_ns;
+    if (arg_count < first + 2 || parse_duration(args[first], &timeout_ns) == -1 || timeout_ns == 0)
+    {
+        fprintf(stderr, "Error: Invalid timeout arguments\n");
+        return 1;
+    }
+
+    // Command runs with this timeout in place of the script wide one
+    long long saved_timeout_ns = options.cmd_timeout_ns;
+    long long saved_kill_after_ns = options.kill_after_ns;
+    options.cmd_timeout_ns = timeout_ns;
+    options.kill_after_ns = kill_after_ns;
+    int rc = run_command(args + first + 1, arg_count - first - 1, local, history, prev_rc, file);
+    options.cmd_timeout_ns = saved_timeout_ns;
+    options.kill_after_ns = saved_kill_after_ns;
+    return rc;
+}
+
+// Usage: ulimit [-t SECONDS] [-v KBYTES] [-n FILES] (value may be unlimited), no flags prints limits
+int built_in_ulimit(char **args, int arg_count)
+{
+    if (arg_count == 1)
+    {
+        for (int i = 0; i < LIMIT_COUNT; i++)
+        {
+            if (options.limits[i] == RLIM_INFINITY)
+            {
+                printf("%s (-%c): unlimited\n", limit_table[i].name, limit_table[i].flag);
+            }
+            else
+            {
+                printf("%s (-%c): %llu\n", limit_table[i].name, limit_table[i].flag,
+                       (unsigned long long)(options.limits[i] / limit_table[i].unit));
+            }
+        }
+        return 0;
+    }
+
+    // Validate everything before changing anything
+    rlim_t limits[LIMIT_COUNT];
+    memcpy(limits, options.limits, sizeof(limits));
+    for (int i = 1; i < arg_count; i += 2)
+    {
+        int slot = -1;
+        for (int j = 0; j < LIMIT_COUNT; j++)
+        {
+            if (args[i][0] == '-' && args[i][1] == limit_table[j].flag && args[i][2] == '\0')
+            {
+                slot = j;
+            }
+        }
+        if (slot == -1 || i + 1 >= arg_count)
+        {
+            fprintf(stderr, "Error: Invalid ulimit arguments\n");
+            return 1;
+        }
+        if (strcmp(args[i + 1], "unlimited") == 0)
+        {
+            limits[slot] = RLIM_INFINITY;
+            continue;
+        }
+        char *end;
+        unsigned long long value = strtoull(args[i + 1], &end, 10);
+        if (*end != '\0' || end == args[i + 1] || value == 0)
+        {
+            fprintf(stderr, "Error: Invalid ulimit value %s\n", args[i + 1]);
+            return 1;
+        }
+        limits[slot] = value * limit_table[slot].unit;
+    }
+    memcpy(options.limits, limits, sizeof(limits));
+    options.settings_generation++;
+    return 0;
+}
+
+// Helper Method: parse a CPU list such as 0-3,8,10-11, returns how many CPUs it names or -1
+int parse_cpu_list(const char *text, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *ptr = text;
+    while (*ptr != '\0')
+    {
+        char *end;
+        long first = strtol(ptr, &end, 10);
+        long last = first;
+        if (end == ptr || first < 0)
+        {
+            return -1;
+        }
+        if (*end == '-')
+        {
+            ptr = end + 1;
+            last = strtol(ptr, &end, 10);
+            if (end == ptr || last < first)
+            {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE || (*end != ',' && *end != '\0'))
+        {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, set);
+        }
+        ptr = *end == ',' ? end + 1 : end;
+    }
+    return CPU_COUNT(set);
+}
+
+// Helper Method: write a CPU set as a list of ranges into buf (CPU_LIST_MAX bytes hold any set)
+void format_cpu_list(cpu_set_t *set, char *buf, size_t size)
+{
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++)
+    {
+        if (!CPU_ISSET(cpu, set))
+        {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+        {
+            last++;
+        }
+        len += snprintf(buf + len, size - len, last > cpu ? "%s%d-%d" : "%s%d", len > 0 ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+// Scheduling policies and I/O classes the run builtin takes
+static const struct
+{
+    const char *name;
+    int value;
+} sched_policies[] = {
+    {"other", SCHED_OTHER},
+    {"batch", SCHED_BATCH},
+    {"idle", SCHED_IDLE},
+    {NULL, 0},
+}, io_classes[] = {
+    {"realtime", 1},
+    {"best-effort", 2},
+    {"idle", 3},
+    {"rt", 1},
+    {"be", 2},
+    {NULL, 0},
+};
+
+// Helper Method: CPU the next child is pinned to when spreading (round-robin over the set), -1 for the whole set
+int sched_next_cpu(void)
+{
+    if (!options.sched.spread || options.sched.cpu_count == 0)
+    {
+        return -1;
+    }
+    int skip = options.next_cpu++ % options.sched.cpu_count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &options.sched.cpus) && skip-- == 0)
+        {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+// Helper Method: apply run settings in child before exec (cpu from sched_next_cpu)
+void apply_sched(int cpu)
+{
+    SchedSettings *sched = &options.sched;
+    if (sched->cpu_count > 0)
+    {
+        cpu_set_t one;
+        cpu_set_t *set = &sched->cpus;
+        if (cpu >= 0)
+        {
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            set = &one;
+        }
+        if (sched_setaffinity(0, sizeof(cpu_set_t), set) == -1)
+        {
+            fprintf(stderr, "Error: could not set CPU affinity\n");
+            exit(-1);
+        }
+    }
+    // Policy first, changing it keeps the nice value set after it
+    struct sched_param param = {0};
+    if (sched->policy >= 0 && sched_setscheduler(0, sched->policy, &param) == -1)
+    {
+        fprintf(stderr, "Error: could not set scheduling policy\n");
+        exit(-1);
+    }
+    if (sched->nice_set && setpriority(PRIO_PROCESS, 0, sched->nice) == -1)
+    {
+        fprintf(stderr, "Error: could not set nice value %d\n", sched->nice);
+        exit(-1);
+    }
+    if (sched->io_class > 0 &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (sched->io_class << IOPRIO_CLASS_SHIFT) | sched->io_level) == -1)
+    {
+        fprintf(stderr, "Error: could not set I/O class\n");
+        exit(-1);
+    }
+}
+
+// Usage: run [--cpus LIST] [--spread] [--nice N] [--sched batch|idle|other] [--io-class C[:LEVEL]] [-- command]
+// With a command the settings apply to it alone, without one they become the default for the commands that follow
+int built_in_run(char **args, int arg_count, LocalVariableList *local, History *history, int prev_rc, FILE *file)
+{
+    SchedSettings *sched = &options.sched;
+    if (arg_count == 1)
+    {
+        printf("cpus: ");
+        if (sched->cpu_count > 0)
+        {
+            char cpus[CPU_LIST_MAX];
+            format_cpu_list(&sched->cpus, cpus, sizeof(cpus));
+            printf(sched->spread ? "%s (spread)\n" : "%s\n", cpus);
+        }
+        else
+        {
+            printf("inherited\n");
+        }
+        sched->nice_set ? printf("nice: %d\n", sched->nice) : printf("nice: inherited\n");
+        const char *policy = "inherited";
+        for (int i = 0; sched_policies[i].name != NULL; i++)
+        {
+            policy = sched->policy == sched_policies[i].value ? sched_policies[i].name : policy;
+        }
+        printf("sched: %s\n", policy);
+        if (sched->io_class > 0)
+        {
+            printf("io-class: %s:%d\n", io_classes[sched->io_class - 1].name, sched->io_level);
+        }
+        else
+        {
+            printf("io-class: inherited\n");
+        }
+        return 0;
+    }
+
+    // Validate everything before changing anything
+    SchedSettings settings = *sched;
+    int first = 1;
+    while (first < arg_count && args[first][0] == '-')
+    {
+        char *flag = args[first];
+        if (strcmp(flag, "--") == 0)
+        {
+            first++;
+            break;
+        }
+        if (strcmp(flag, "--spread") == 0)
+        {
+            settings.spread = 1;
+            first++;
+            continue;
+        }
+        char *value = first + 1 < arg_count ? args[first + 1] : NULL;
+        int ok = value != NULL;
+        if (ok && strcmp(flag, "--cpus") == 0)
+        {
+            cpu_set_t allowed;
+            settings.cpu_count = parse_cpu_list(value, &settings.cpus);
+            ok = settings.cpu_count > 0 && sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+            if (ok)
+            {
+                // Asking for CPUs the shell itself may not use would only fail in the child
+                CPU_AND(&allowed, &allowed, &settings.cpus);
+                ok = CPU_COUNT(&allowed) == settings.cpu_count;
+            }
+        }
+        else if (ok && strcmp(flag, "--nice") == 0)
+        {
+            char *end;
+            long nice_value = strtol(value, &end, 10);
+            ok = *end != '\0' || end == value || nice_value < -20 || nice_value > 19 ? 0 : 1;
+            settings.nice_set = 1;
+            settings.nice = (int)nice_value;
+        }
+        else if (ok && strcmp(flag, "--sched") == 0)
+        {
+            ok = 0;
+            for (int i = 0; sched_policies[i].name != NULL; i++)
+            {
+                if (strcmp(value, sched_policies[i].name) == 0)
+                {
+                    settings.policy = sched_policies[i].value;
+                    ok = 1;
+                }
+            }
+        }
+        else if (ok && strcmp(flag, "--io-class") == 0)
+        {
+            // Class by name or number as in ionice -c, optional :LEVEL (0 highest to 7)
+            size_t name_len = strcspn(value, ":");
+            settings.io_class = 0;
+            settings.io_level = IOPRIO_DEFAULT_LEVEL;
+            for (int i = 0; io_classes[i].name != NULL; i++)
+            {
+                if ((name_len == strlen(io_classes[i].name) && strncmp(value, io_classes[i].name, name_len) == 0) ||
+                    (name_len == 1 && value[0] == '0' + io_classes[i].value))
+                {
+                    settings.io_class = io_classes[i].value;
+                }
+            }
+            if (value[name_len] == ':')
+            {
+                char *end;
+                settings.io_level = (int)strtol(value + name_len + 1, &end, 10);
+                ok = *end == '\0' && end != value + name_len + 1 && settings.io_level >= 0 && settings.io_level <= 7;
+            }
+            ok = ok && settings.io_class > 0;
+        }
+        else
+        {
+            ok = 0;
+        }
+        if (!ok)
+        {
+            fprintf(stderr, "Error: Invalid run argument %s %s\n", flag, value != NULL ? value : "");
+            return 1;
+        }
+        first += 2;
+    }
+
+    if (first >= arg_count)
+    {
+        *sched = settings;
+        options.settings_generation++;
+        return 0;
+    }
+    // Command runs with these settings in place of the script wide ones
+    SchedSettings saved = *sched;
+    *sched = settings;
+    int rc = run_command(args + first, arg_count - first, local, history, prev_rc, file);
+    *sched = saved;
+    return rc;
+}
+
+// Helper Method: free a parsed sourced file
+void free_source_file(SourceFile *source)
+{
+    free(source->text);
+    free(source->lines);
+    free(source);
+}
+
+// Helper Method: read a file and split it into the lines handle_argument would run, NULL if it cannot be read
+SourceFile *parse_source_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    SourceFile *source = calloc(1, sizeof(SourceFile));
+    size_t cap = st.st_size + 1;
+    size_t len = 0;
+    char *text = malloc(cap);
+    ssize_t n = 0;
+    while (source != NULL && text != NULL)
+    {
+        // The file may have grown since fstat
+        if (len + 1 == cap)
+        {
+            char *grown = realloc(text, cap * 2);
+            if (grown == NULL)
+            {
+                break;
+            }
+            text = grown;
+            cap *= 2;
+        }
+        if ((n = read(fd, text + len, cap - 1 - len)) <= 0)
+        {
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+    if (source == NULL || text == NULL || n != 0)
+    {
+        free(source);
+        free(text);
+        return NULL;
+    }
+    text[len] = '\0';
+    source->dev = st.st_dev;
+    source->ino = st.st_ino;
+    source->mtime = st.st_mtim;
+    // What was read, the file may have changed size since fstat
+    source->size = len;
+    source->text = text;
+
+    int line_cap = 0;
+    long number = 0;
+    size_t start = 0;
+    while (start < len)
+    {
+        char *newline = memchr(text + start, '\n', len - start);
+        size_t end = newline != NULL ? (size_t)(newline - text) : len;
+        number++;
+        char first = text[start + strspn(text + start, " ")];
+        if (first != '\n' && first != '\0' && first != '#')
+        {
+            if (source->line_count == line_cap)
+            {
+                line_cap = line_cap ? line_cap * 2 : 64;
+                SourceLine *lines = realloc(source->lines, line_cap * sizeof(SourceLine));
+                if (lines == NULL)
+                {
+                    free_source_file(source);
+                    return NULL;
+                }
+                source->lines = lines;
+            }
+            SourceLine *line = &source->lines[source->line_count++];
+            line->offset = start;
+            line->length = end - start;
+            line->number = number;
+        }
+        start = end + 1;
+    }
+    return source;
+}
+
+// Helper Method: parsed form of a file, reused while its inode, mtime and size are unchanged
+// A same-size edit within one mtime tick goes unnoticed, as with make
+SourceFile *source_lookup(SourceCache *cache, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < cache->count; i++)
+    {
+        SourceFile *source = cache->files[i];
+        if (source->dev != st.st_dev || source->ino != st.st_ino)
+        {
+            continue;
+        }
+        if (source->mtime.tv_sec == st.st_mtim.tv_sec && source->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+            source->size == st.st_size)
+        {
+            source->last_used = ++cache->clock;
+            return source;
+        }
+        // Edited since it was parsed, a run still going keeps the old copy
+        cache->files[i] = cache->files[--cache->count];
+        if (source->users > 0)
+        {
+            source->stale = 1;
+        }
+        else
+        {
+            free_source_file(source);
+        }
+        break;
+    }
+
+    SourceFile *source = parse_source_file(path);
+    if (source == NULL)
+    {
+        return NULL;
+    }
+    source->last_used = ++cache->clock;
+    if (cache->count == SOURCE_CACHE_MAX)
+    {
+        // Evict the least recently used file not being run, or run this one uncached
+        int oldest = -1;
+        for (int i = 0; i < cache->count; i++)
+        {
+            if (cache->files[i]->users == 0 && (oldest < 0 || cache->files[i]->last_used < cache->files[oldest]->last_used))
+            {
+                oldest = i;
+            }
+        }
+        if (oldest < 0)
+        {
+            source->stale = 1;
+            return source;
+        }
+        free_source_file(cache->files[oldest]);
+        cache->files[oldest] = cache->files[--cache->count];
+    }
+    cache->files[cache->count++] = source;
+    return source;
+}
+
+// Helper Method: run the lines of a parsed file in the current shell, returns the last exit code
+int run_source_file(SourceFile *source, LocalVariableList *local, History *history, int prev_rc)
+{
+    if (source->line_count == 0)
+    {
+        return 0;
+    }
+    // Here-document bodies are read from a stream over the cached text, lines they consume are skipped
+    FILE *stream = fmemopen(source->text, source->size, "r");
+    if (stream == NULL)
+    {
+        fprintf(stderr, "Error: could not read sourced file\n");
+        return 1;
+    }
+    char input[MAXLINE];
+    long consumed = 0;
+    for (int i = 0; i < source->line_count; i++)
+    {
+        SourceLine *line = &source->lines[i];
+        if (line->offset < consumed)
+        {
+            continue;
+        }
+        // handle_argument tokenizes in place, the cached text stays intact
+        size_t len = line->length < MAXLINE ? (size_t)line->length : MAXLINE - 1;
+        memcpy(input, source->text + line->offset, len);
+        input[len] = '\0';
+        long next = line->offset + line->length + 1;
+        fseek(stream, next < source->size ? next : source->size, SEEK_SET);
+        // Capture, trace and journal keep the line that sourced the file, only the profile numbers within it
+        fflush(stdout);
+        if (options.profile.path != NULL)
+        {
+            ProfileMark mark = profile_begin_line(&options.profile, line->number, input);
+            prev_rc = handle_argument(input, local, history, prev_rc, stream);
+            profile_end_line(&options.profile, &mark);
+        }
+        else
+        {
+            prev_rc = handle_argument(input, local, history, prev_rc, stream);
+        }
+        consumed = ftell(stream);
+    }
+    fclose(stream);
+    return prev_rc;
+}
+
+// Usage: source FILE or . FILE
+// Runs FILE in this shell, so its variables, exports and cd stay in effect afterwards
+int built_in_source(char **args, int arg_count, LocalVariableList *local, History *history, int prev_rc)
+{
+    if (arg_count != 2)
+    {
+        fprintf(stderr, "Usage: %s FILE\n", args[0]);
+        return 1;
+    }
+    SourceCache *cache = &options.sources;
+    if (cache->depth >= SOURCE_MAX_DEPTH)
+    {
+        fprintf(stderr, "Error: %s nested more than %d deep\n", args[0], SOURCE_MAX_DEPTH);
+        return 1;
+    }
+    SourceFile *source = source_lookup(cache, args[1]);
+    if (source == NULL)
+    {
+        fprintf(stderr, "Error: Could not access file: %s\n", args[1]);
+        return 1;
+    }
+
+    // Lines are profiled under the line that sourced the file
+    int context = options.profile.path != NULL ? profile_push_context(&options.profile, args[1]) : -1;
+    cache->depth++;
+    source->users++;
+    int rc = run_source_file(source, local, history, prev_rc);
+    source->users--;
+    cache->depth--;
+    if (options.profile.path != NULL)
+    {
+        profile_pop_context(&options.profile, context);
+    }
+    if (source->stale && source->users == 0)
+    {
+        free_source_file(source);
+    }
+    return rc;
+}
+
+// Options for set -o NAME and set +o NAME
+static const struct
+{
+    const char *name;
+    int *value;
+} set_options[] = {
+    {"argsplit", &options.argsplit},
+    {"fdcache", &options.files.enabled},
+    {"xtrace", &options.trace.xtrace},
+    {NULL, NULL},
+};
+
+// Usage: set -o NAME or set +o NAME, no arguments lists the options
+int built_in_set(char **args, int arg_count)
+{
+    if (arg_count == 1)
+    {
+        for (int i = 0; set_options[i].name != NULL; i++)
+        {
+            printf("%s %s\n", set_options[i].name, *set_options[i].value ? "on" : "off");
+        }
+        return 0;
+    }
+    // -x and +x are short for -o xtrace and +o xtrace
+    if (arg_count == 2 && (strcmp(args[1], "-x") == 0 || strcmp(args[1], "+x") == 0))
+    {
+        options.trace.xtrace = args[1][0] == '-';
+        options.settings_generation++;
+        return 0;
+    }
+    if (arg_count == 3 && (strcmp(args[1], "-o") == 0 || strcmp(args[1], "+o") == 0))
+    {
+        for (int i = 0; set_options[i].name != NULL; i++)
+        {
+            if (strcmp(args[2], set_options[i].name) == 0)
+            {
+                *set_options[i].value = args[1][0] == '-';
+                options.settings_generation++;
+                return 0;
+            }
+        }
+    }
+    fprintf(stderr, "Error: Invalid set arguments\n");
+    return 1;
+}
+
+// Usage: trace dump (latest commands, oldest first) or trace clear
+int built_in_trace(char **args, int arg_count)
+{
+    if (arg_count == 2 && strcmp(args[1], "dump") == 0)
+    {
+        fflush(stdout);
+        // The dump itself is still running, it shows as the last record
+        trace_dump(&options.trace, STDOUT_FILENO);
+        return 0;
+    }
+    if (arg_count == 2 && strcmp(args[1], "clear") == 0)
+    {
+        options.trace.next = 0;
+        return 0;
+    }
+    fprintf(stderr, "Error: Invalid trace arguments\n");
+    return 1;
+}
+
+// Usage: split [-j N] command [args...]
+// Runs command in as many batches as ARG_MAX needs (N at a time), otherwise exactly as without split
+int built_in_split(char **args, int arg_count, LocalVariableList *local, History *history, int prev_rc, FILE *file)
+{
+    int first = 1;
+    long jobs = 1;
+    if (arg_count > 2 && strcmp(args[1], "-j") == 0)
+    {
+        char *end;
+        jobs = strtol(args[2], &end, 10);
+        if (*end != '\0' || jobs < 1 || jobs > MAXPARALLEL)
+        {
+            fprintf(stderr, "Error: split job count must be 1 to %d\n", MAXPARALLEL);
+            return 1;
+        }
+        first = 3;
+    }
+    if (arg_count <= first)
+    {
+        fprintf(stderr, "Error: Invalid split arguments\n");
+        return 1;
+    }
+    long saved_jobs = options.split_jobs;
+    options.split_jobs = jobs;
+    int rc = run_command(args + first, arg_count - first, local, history, prev_rc, file);
+    options.split_jobs = saved_jobs;
+    return rc;
+}
+
+// Helper Method: redirect type a word asks for (NR if it is no redirect)
+int redirect_word_type(const char *word)
+{
+    if (strstr(word, "&>>") != NULL)
+    {
+        return ASOSE;
+    }
+    if (strstr(word, "&>") != NULL)
+    {
+        return RSOSE;
+    }
+    if (strstr(word, ">>") != NULL)
+    {
+        return ARO;
+    }
+    if (strstr(word, ">") != NULL)
+    {
+        return RO;
+    }
+    if (strstr(word, "<<<") != NULL)
+    {
+        return HS;
+    }
+    if (strstr(word, "<<") != NULL)
+    {
+        return HD;
+    }
+    if (strstr(word, "<") != NULL)
+    {
+        return RI;
+    }
+    return NR;
+}
+
+// Helper Method: descriptor an output redirect word replaces (N in N>file, stdout by default)
+int redirect_word_fd(const char *word)
+{
+    int parse = atoi(word);
+    return parse != 0 ? parse : STDOUT_FILENO;
+}
+
+void crop_redirect(char **args, int *arg_count)
+{
+    args[*arg_count - 1] = NULL;
+    (*arg_count)--;
+}
+
+// Helper Method: descriptor number written in word (digits only), -1 otherwise
+int parse_fd_word(const char *word)
+{
+    if (word[0] == '\0' || word[strspn(word, "0123456789")] != '\0' || strlen(word) > 6)
+    {
+        return -1;
+    }
+    return atoi(word);
+}
+
+// Helper Method: move a descriptor the shell keeps open to EXEC_MAXFD or above, out of the way of exec N>file
+int move_fd_high(int fd)
+{
+    if (fd < 0 || fd >= EXEC_MAXFD)
+    {
+        return fd;
+    }
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, EXEC_MAXFD);
+    close(fd);
+    return high;
+}
+
+// Helper Method: close a cached redirect target (its watch goes too unless another entry shares the inode)
+void file_cache_drop(FileCache *cache, int index)
+{
+    OpenFile *file = &cache->files[index];
+    int shared = 0;
+    for (int i = 0; i < cache->count; i++)
+    {
+        shared |= i != index && cache->files[i].watch == file->watch;
+    }
+    if (!shared && file->watch >= 0)
+    {
+        inotify_rm_watch(cache->inotify_fd, file->watch);
+    }
+    close(file->fd);
+    free(file->path);
+    cache->files[index] = cache->files[--cache->count];
+}
+
+// Helper Method: drop every cached target whose file was unlinked or moved since the last redirect
+// One non-blocking read when nothing happened, no path lookups
+void file_cache_poll(FileCache *cache)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(cache->inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *ptr = buf; ptr < buf + len;)
+        {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            for (int i = cache->count - 1; i >= 0; i--)
+            {
+                if (cache->files[i].watch != event->wd)
+                {
+                    continue;
+                }
+                // Unlinking shows up as an attribute change (link count), the inode lives on while we hold it
+                struct stat st;
+                if ((event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) || fstat(cache->files[i].fd, &st) == -1 ||
+                    st.st_nlink == 0)
+                {
+                    if (event->mask & IN_IGNORED)
+                    {
+                        cache->files[i].watch = -1;
+                    }
+                    file_cache_drop(cache, i);
+                }
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+// Helper Method: close every cached target (set +o fdcache)
+void file_cache_clear(FileCache *cache)
+{
+    while (cache->count > 0)
+    {
+        file_cache_drop(cache, cache->count - 1);
+    }
+}
+
+// Helper Method: open a redirect target, append targets come from the open-file cache when set -o fdcache is on
+// Returns the descriptor and whether it belongs to the cache (and must not be closed)
+int open_redirect_target(const char *path, int flags, int *cached)
+{
+    FileCache *cache = &options.files;
+    *cached = 0;
+    if (!cache->enabled || !(flags & O_APPEND))
+    {
+        if (cache->count > 0 && !cache->enabled)
+        {
+            file_cache_clear(cache);
+        }
+        return move_fd_high(open(path, flags | O_CLOEXEC, 0644));
+    }
+    if (cache->inotify_fd < 0)
+    {
+        cache->inotify_fd = move_fd_high(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+        if (cache->inotify_fd < 0)
+        {
+            return move_fd_high(open(path, flags | O_CLOEXEC, 0644));
+        }
+    }
+    file_cache_poll(cache);
+
+    // Key is path and flags, and the directory for relative paths
+    for (int i = 0; i < cache->count; i++)
+    {
+        OpenFile *file = &cache->files[i];
+        if (file->flags == flags && strcmp(file->path, path) == 0)
+        {
+            if (path[0] != '/' && file->cwd_generation != cache->cwd_generation)
+            {
+                file_cache_drop(cache, i);
+                break;
+            }
+            file->used = ++cache->clock;
+            *cached = 1;
+            return file->fd;
+        }
+    }
+
+    int fd = move_fd_high(open(path, flags | O_CLOEXEC, 0644));
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        return fd;
+    }
+    // Full cache gives up its least recently used file
+    if (cache->count == FILECACHE_MAX)
+    {
+        int oldest = 0;
+        for (int i = 1; i < cache->count; i++)
+        {
+            oldest = cache->files[i].used < cache->files[oldest].used ? i : oldest;
+        }
+        file_cache_drop(cache, oldest);
+    }
+    OpenFile *file = &cache->files[cache->count];
+    file->path = strdup(path);
+    // Entries for the same inode (other path or flags) get the same watch back
+    file->watch = inotify_add_watch(cache->inotify_fd, path, IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (file->path == NULL || file->watch < 0)
+    {
+        free(file->path);
+        return fd;
+    }
+    file->flags = flags;
+    file->fd = fd;
+    file->cwd_generation = cache->cwd_generation;
+    file->used = ++cache->clock;
+    cache->count++;
+    *cached = 1;
+    return fd;
+}
+
+// Helper Method: point target at fd, remembering the original so restore_redirect can undo it
+int redirect_fd(int fd, int target, SavedFds *saved)
+{
+    if (saved->count == MAXREDIRECTS)
+    {
+        return -1;
+    }
+    // Copy is -1 if target was not open before
+    int copy = fcntl(target, F_DUPFD_CLOEXEC, 10);
+    if (dup2(fd, target) == -1)
+    {
+        if (copy >= 0)
+        {
+            close(copy);
+        }
+        return -1;
+    }
+    saved->fds[saved->count] = target;
+    saved->saved[saved->count] = copy;
+    saved->count++;
+    return 0;
+}
+
+// Helper Method: undo redirects (latest first) once the command is done
+void restore_redirect(SavedFds *saved)
+{
+    // Builtins print through stdio, push that out before switching back
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = saved->count - 1; i >= 0; i--)
+    {
+        if (saved->saved[i] >= 0)
+        {
+            dup2(saved->saved[i], saved->fds[i]);
+            close(saved->saved[i]);
+        }
+        else
+        {
+            close(saved->fds[i]);
+        }
+    }
+    saved->count = 0;
+    // The pump sees end of file now that the shell's copy of its pipe is gone
+    while (saved->pump > 0 && waitpid(saved->pump, NULL, 0) == -1 && errno == EINTR)
+    {
+    }
+    saved->pump = 0;
+}
+
+// Helper Method: write whole buffer, retrying short writes
+int write_all(int fd, const void *buf, size_t len)
+{
+    const char *ptr = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, ptr, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        ptr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Helper Method: monotonic clock in nanoseconds
+long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Helper Method: wall clock in nanoseconds
+int64_t realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Helper Method: write n in decimal at dest, returns the digits written
+int format_decimal(char *dest, long long n)
+{
+    char digits[24];
+    int count = 0;
+    do
+    {
+        digits[count++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    for (int i = 0; i < count; i++)
+    {
+        dest[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+// Helper Method: write n (not negative) in decimal at dest, zero padded to width digits
+int format_padded(char *dest, long long n, int width)
+{
+    int count = 0;
+    for (long long rest = n; width > 1 && rest >= 10; rest /= 10)
+    {
+        width--;
+    }
+    while (count < width - 1)
+    {
+        dest[count++] = '0';
+    }
+    return count + format_decimal(dest + count, n);
+}
+
+// Helper Method: format a trace record as one line, returns its length
+// Only plain stores here, the SIGUSR1 handler formats records too
+int trace_format(TraceRecord *record, char *buf)
+{
+    char *dest = buf;
+    int64_t end_ns = record->end_ns;
+    *dest++ = '+';
+    *dest++ = ' ';
+    dest += format_decimal(dest, record->start_ns / 1000000000LL);
+    *dest++ = '.';
+    dest += format_padded(dest, record->start_ns / 1000 % 1000000, 6);
+    memcpy(dest, " line ", 6);
+    dest += 6;
+    dest += format_decimal(dest, record->line);
+    memcpy(dest, " pid ", 5);
+    dest += 5;
+    if (record->pid > 0)
+    {
+        dest += format_decimal(dest, record->pid);
+    }
+    else
+    {
+        *dest++ = '-';
+    }
+    if (end_ns == 0)
+    {
+        memcpy(dest, " running: ", 10);
+        dest += 10;
+    }
+    else
+    {
+        long long us = (end_ns - record->start_ns) / 1000;
+        memcpy(dest, " rc ", 4);
+        dest += 4;
+        if (record->exit_code < 0)
+        {
+            *dest++ = '-';
+        }
+        dest += format_decimal(dest, record->exit_code < 0 ? -(long long)record->exit_code : record->exit_code);
+        *dest++ = ' ';
+        dest += format_decimal(dest, us < 0 ? 0 : us / 1000);
+        *dest++ = '.';
+        dest += format_padded(dest, us < 0 ? 0 : us % 1000, 3);
+        memcpy(dest, "ms: ", 4);
+        dest += 4;
+    }
+    size_t len = strnlen(record->text, TRACE_TEXT - 1);
+    memcpy(dest, record->text, len);
+    dest += len;
+    *dest++ = '\n';
+    return dest - buf;
+}
+
+// Helper Method: claim the next ring slot for a command about to run (expanded words, redirect included)
+TraceRecord *trace_begin(Tracer *trace, char **args, int arg_count)
+{
+    TraceRecord *record = &trace->records[trace->next % TRACE_RECORDS];
+    // Cleared first so a dump from the signal handler never sees half old, half new text
+    record->end_ns = 0;
+    record->text[0] = '\0';
+    record->pid = 0;
+    record->line = options.line_number;
+    record->start_ns = realtime_ns();
+    char *dest = record->text;
+    char *limit = record->text + TRACE_TEXT - 4;
+    for (int i = 0; i < arg_count && args[i] != NULL; i++)
+    {
+        size_t len = strlen(args[i]);
+        if (i > 0)
+        {
+            *dest++ = ' ';
+        }
+        if (len >= (size_t)(limit - dest))
+        {
+            // Cut long lines, marked with an ellipsis (dest stays below limit until then)
+            len = limit - dest;
+            memcpy(dest, args[i], len);
+            memcpy(dest + len, "...", 3);
+            dest += len + 3;
+            break;
+        }
+        memcpy(dest, args[i], len);
+        dest += len;
+    }
+    *dest = '\0';
+    trace->next++;
+    trace->current = record;
+    return record;
+}
+
+// Helper Method: finish a command's record, previous is the record that was running around it (or NULL)
+void trace_end(Tracer *trace, TraceRecord *record, TraceRecord *previous, int exit_code)
+{
+    record->exit_code = exit_code;
+    record->end_ns = realtime_ns();
+    trace->current = previous;
+    if (trace->xtrace)
+    {
+        char line[TRACE_TEXT + 128];
+        write_all(STDERR_FILENO, line, trace_format(record, line));
+    }
+}
+
+// Helper Method: write the ring to fd, oldest record first
+// Safe to call from a signal handler (no stdio or allocation)
+void trace_dump(Tracer *trace, int fd)
+{
+    unsigned long next = trace->next;
+    unsigned long first = next > TRACE_RECORDS ? next - TRACE_RECORDS : 0;
+    char line[TRACE_TEXT + 128];
+    for (unsigned long i = first; i < next; i++)
+    {
+        write_all(fd, line, trace_format(&trace->records[i % TRACE_RECORDS], line));
+    }
+}
+
+// Helper Method: SIGUSR1 handler, dumps the trace to stderr while the script keeps running
+void trace_signal(int sig)
+{
+    (void)sig;
+    int saved_errno = errno;
+    trace_dump(&options.trace, STDERR_FILENO);
+    errno = saved_errno;
+}
+
+// Helper Method: open capture.log and capture.idx in dir
+int open_capture(char *dir, CaptureLog *capture)
+{
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "Error: could not create capture dir %s\n", dir);
+        return -1;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/capture.log", dir);
+    capture->log_fd = move_fd_high(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    snprintf(path, sizeof(path), "%s/capture.idx", dir);
+    capture->index_fd = move_fd_high(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    capture->offset = 0;
+    if (capture->log_fd == -1 || capture->index_fd == -1)
+    {
+        fprintf(stderr, "Error: could not open capture files in %s\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+// Helper Method: append one output chunk to capture.log
+void capture_chunk(CaptureLog *capture, uint32_t line, int stream, const char *data, size_t len)
+{
+    CaptureRecord record = {line, (uint32_t)len, realtime_ns(), (uint8_t)stream, {0}};
+    struct iovec iov[2] = {{&record, sizeof(record)}, {(void *)data, len}};
+    ssize_t written = writev(capture->log_fd, iov, 2);
+    if (written > 0)
+    {
+        capture->offset += written;
+    }
+    if (written != (ssize_t)(sizeof(record) + len))
+    {
+        fprintf(stderr, "Error: short write to capture log\n");
+    }
+}
+
+// Helper Method: add a reaped child's resource usage to the profiler's running totals
+void note_child_usage(struct rusage *usage)
+{
+    options.profile.child_cpu_ns += (long long)(usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000000LL +
+                                    (long long)(usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) * 1000;
+}
+
+// Helper Method: wait for a child and account its CPU time
+pid_t wait_reap(pid_t pid, int *status)
+{
+    struct rusage usage;
+    pid_t reaped = wait4(pid, status, 0, &usage);
+    if (reaped == pid)
+    {
+        note_child_usage(&usage);
+    }
+    return reaped;
+}
+
+// Helper Method: wait for child, draining capture pipes (out_fd/err_fd, -1 when not capturing)
+// and enforcing timeout_ns (0 for none) with SIGTERM then SIGKILL to the child's process group
+// Returns 1 when the command timed out, 0 when not and -1 on failure
+int wait_child(pid_t pid, int out_fd, int err_fd, long long timeout_ns, int *status)
+{
+    int pidfd = timeout_ns > 0 ? pidfd_open(pid, 0) : -1;
+    int epoll_fd = -1;
+    if (pidfd >= 0 || out_fd >= 0)
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    // Slot 0 is the child, 1 and 2 its stdout and stderr
+    int fds[3] = {pidfd, out_fd, err_fd};
+    int watching = 0;
+    for (int slot = 0; slot < 3; slot++)
+    {
+        struct epoll_event event = {EPOLLIN, {.u32 = slot}};
+        if (fds[slot] >= 0 && epoll_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[slot], &event) == 0)
+        {
+            watching++;
+        }
+    }
+
+    // Without a pidfd (older kernels, seccomp) the child is polled with WNOHANG so the deadline still holds
+    int poll_child = timeout_ns > 0 && pidfd < 0;
+    int exited = 0;
+    int timed_out = 0;
+    long long deadline = timeout_ns > 0 ? monotonic_ns() + timeout_ns : 0;
+    char buf[65536];
+    while (watching > 0 || (poll_child && !exited))
+    {
+        // Escalate once the deadline passes, grandchildren may still hold the pipes after the child exits
+        int wait_ms = -1;
+        if (deadline > 0)
+        {
+            long long left = deadline - monotonic_ns();
+            if (left <= 0)
+            {
+                kill(-pid, timed_out ? SIGKILL : SIGTERM);
+                deadline = timed_out ? 0 : monotonic_ns() + options.kill_after_ns;
+                timed_out = 1;
+                continue;
+            }
+            wait_ms = (int)((left + 999999) / 1000000);
+        }
+        if (poll_child && !exited)
+        {
+            struct rusage usage;
+            if (wait4(pid, status, WNOHANG, &usage) == pid)
+            {
+                note_child_usage(&usage);
+                exited = 1;
+                continue;
+            }
+            wait_ms = wait_ms < 0 || wait_ms > TIMEOUT_POLL_MS ? TIMEOUT_POLL_MS : wait_ms;
+            if (watching == 0)
+            {
+                poll(NULL, 0, wait_ms);
+                continue;
+            }
+        }
+
+        struct epoll_event events[3];
+        int ready = epoll_wait(epoll_fd, events, 3, wait_ms);
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready < 0)
+        {
+            break;
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            int slot = events[i].data.u32;
+            ssize_t n = 0;
+            if (slot == 0)
+            {
+                exited = wait_reap(pid, status) == pid;
+            }
+            else
+            {
+                n = read(fds[slot], buf, sizeof(buf));
+            }
+            if (n > 0)
+            {
+                capture_chunk(&options.capture, options.line_number, slot, buf, n);
+                write_all(slot, buf, n);
+            }
+            else if (slot == 0 || n == 0 || errno != EINTR)
+            {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fds[slot], NULL);
+                close(fds[slot]);
+                fds[slot] = -1;
+                watching--;
+            }
+        }
+    }
+
+    // Close anything epoll could not watch
+    for (int slot = 0; slot < 3; slot++)
+    {
+        if (fds[slot] >= 0)
+        {
+            close(fds[slot]);
+        }
+    }
+    if (epoll_fd >= 0)
+    {
+        close(epoll_fd);
+    }
+    if (!exited && wait_reap(pid, status) != pid)
+    {
+        return -1;
+    }
+    return timed_out;
+}
+
+// Helper Method: record a finished command in capture.idx
+void capture_index(CaptureLog *capture, uint32_t line, int exit_code, uint32_t flags, uint64_t offset, int64_t start_ns)
+{
+    CaptureIndexEntry entry = {line, exit_code, offset, capture->offset - offset, start_ns, realtime_ns(), flags, 0};
+    if (write_all(capture->index_fd, &entry, sizeof(entry)) == -1)
+    {
+        fprintf(stderr, "Error: could not write capture index\n");
+    }
+}
+
+// Reader: print captured output of one script line, or list the index without a line
+int read_capture(char *dir, char *line_arg)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/capture.idx", dir);
+    int index_fd = open(path, O_RDONLY | O_CLOEXEC);
+    snprintf(path, sizeof(path), "%s/capture.log", dir);
+    int log_fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (index_fd == -1 || log_fd == -1 || fstat(index_fd, &st) == -1)
+    {
+        fprintf(stderr, "Error: could not open capture in %s\n", dir);
+        return 1;
+    }
+    long count = st.st_size / sizeof(CaptureIndexEntry);
+    CaptureIndexEntry entry;
+
+    // No line given, list the index
+    if (line_arg == NULL)
+    {
+        for (long i = 0; i < count; i++)
+        {
+            if (pread(index_fd, &entry, sizeof(entry), i * sizeof(entry)) != sizeof(entry))
+            {
+                break;
+            }
+            printf("line %u: exit %d, %llu bytes, %lld ms%s\n", entry.line, entry.exit_code,
+                   (unsigned long long)entry.length, (long long)(entry.end_ns - entry.start_ns) / 1000000,
+                   entry.flags & CAPTURE_TIMED_OUT ? ", timed out" : "");
+        }
+        return 0;
+    }
+
+    // Line numbers never decrease, binary search the first entry for the line
+    uint32_t line = strtoul(line_arg, NULL, 10);
+    long lo = 0;
+    long hi = count;
+    while (lo < hi)
+    {
+        long mid = lo + (hi - lo) / 2;
+        if (pread(index_fd, &entry, sizeof(entry), mid * sizeof(entry)) != sizeof(entry))
+        {
+            return 1;
+        }
+        if (entry.line < line)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    int found = 0;
+    char buf[65536];
+    for (long i = lo; i < count; i++)
+    {
+        if (pread(index_fd, &entry, sizeof(entry), i * sizeof(entry)) != sizeof(entry) || entry.line != line)
+        {
+            break;
+        }
+        found = 1;
+        // Seek straight to the command's records
+        uint64_t pos = entry.offset;
+        while (pos < entry.offset + entry.length)
+        {
+            CaptureRecord record;
+            if (pread(log_fd, &record, sizeof(record), pos) != sizeof(record))
+            {
+                break;
+            }
+            pos += sizeof(record);
+            uint64_t left = record.length;
+            while (left > 0)
+            {
+                ssize_t n = pread(log_fd, buf, left < sizeof(buf) ? left : sizeof(buf), pos);
+                if (n <= 0)
+                {
+                    break;
+                }
+                write_all(record.stream == STDERR_FILENO ? STDERR_FILENO : STDOUT_FILENO, buf, n);
+                pos += n;
+                left -= n;
+            }
+        }
+    }
+    if (!found)
+    {
+        fprintf(stderr, "Error: no captured output for line %u\n", line);
+        return 1;
+    }
+    return 0;
+}
+
+// Helper Method: fold bytes into both lanes of a cache key (FNV-1a, the second lane sees each byte shifted)
+void cache_key_add(CacheKey *key, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        key->a = (key->a ^ bytes[i]) * 1099511628211ULL;
+        key->b = (key->b ^ (unsigned char)(bytes[i] + 0x5b)) * 1099511628211ULL;
+        key->b ^= key->b >> 29;
+    }
+}
+
+// Helper Method: fold a whole input file into the key, -1 when it cannot be read
+int cache_key_add_file(CacheKey *key, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    char buf[65536];
+    ssize_t n;
+    cache_key_add(key, path, strlen(path) + 1);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        cache_key_add(key, buf, n);
+    }
+    close(fd);
+    return n == 0 ? 0 : -1;
+}
+
+// Helper Method: copy len bytes of from (starting at offset) to fd to
+int copy_fd_range(int from, off_t offset, uint64_t len, int to)
+{
+    char buf[65536];
+    while (len > 0)
+    {
+        ssize_t n = pread(from, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+        if (n <= 0 || write_all(to, buf, n) == -1)
+        {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Helper Method: cache store directory, BARBER_CACHE_DIR or ~/.cache/barber (created on first use)
+int cache_dir(LocalVariableList *local, char *dir, size_t size)
+{
+    char *configured = get_variable(local, "BARBER_CACHE_DIR");
+    char *home = get_variable(local, "HOME");
+    if (configured != NULL)
+    {
+        snprintf(dir, size, "%s", configured);
+    }
+    else
+    {
+        snprintf(dir, size, "%s/.cache", home != NULL ? home : "/tmp");
+        mkdir(dir, 0755);
+        snprintf(dir, size, "%s/.cache/barber", home != NULL ? home : "/tmp");
+    }
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "Error: could not create cache dir %s\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+// Helper Method: compare cache entries by last use for eviction
+int compare_cache_use(const void *a, const void *b)
+{
+    const CacheUse *left = a;
+    const CacheUse *right = b;
+    return (left->used > right->used) - (left->used < right->used);
+}
+
+// Helper Method: drop least recently used entries until the store fits in max_bytes
+// An entry's mtime is its last use, hits refresh it
+void cache_evict(const char *dir, uint64_t max_bytes)
+{
+    DirListing *listing = read_dir_listing(dir);
+    if (listing == NULL)
+    {
+        return;
+    }
+    CacheUse *entries = malloc(sizeof(CacheUse) * (listing->count + 1));
+    int count = 0;
+    uint64_t total = 0;
+    char path[PATH_MAX];
+    for (int i = 0; entries != NULL && i < listing->count; i++)
+    {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, listing->names[i]);
+        if (strlen(listing->names[i]) != CACHE_NAME_LEN || stat(path, &st) == -1)
+        {
+            continue;
+        }
+        entries[count].used = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        entries[count].size = st.st_size;
+        entries[count].name = listing->names[i];
+        total += st.st_size;
+        count++;
+    }
+    if (entries != NULL && total > max_bytes)
+    {
+        qsort(entries, count, sizeof(CacheUse), compare_cache_use);
+        for (int i = 0; i < count && total > max_bytes; i++)
+        {
+            snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+            if (unlink(path) == 0)
+            {
+                total -= entries[i].size;
+            }
+        }
+    }
+    free(entries);
+    free_dir_listing(listing);
+}
+
+// Helper Method: replay a stored entry's stdout, stderr and exit code, -1 when fd is not a valid entry
+int cache_replay(int fd, int *exit_code)
+{
+    CacheHeader header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != CACHE_MAGIC || fstat(fd, &st) == -1 ||
+        (uint64_t)st.st_size != sizeof(header) + header.out_len + header.err_len)
+    {
+        return -1;
+    }
+    fflush(stdout);
+    if (copy_fd_range(fd, sizeof(header), header.out_len, STDOUT_FILENO) == -1 ||
+        copy_fd_range(fd, sizeof(header) + header.out_len, header.err_len, STDERR_FILENO) == -1)
+    {
+        fprintf(stderr, "Error: cache could not replay output\n");
+    }
+    *exit_code = header.exit_code;
+    return 0;
+}
+
+// Usage: cache [--inputs FILES...] -- command [args...]
+// Runs command once per distinct argv, environment, directory and input file contents, later runs replay its
+// stdout, stderr and exit code from a content addressed store (BARBER_CACHE_DIR, BARBER_CACHE_SIZE bytes)
+int built_in_cache(char **args, int arg_count, LocalVariableList *local, History *history, int prev_rc, FILE *file)
+{
+    int inputs = 0;
+    int first = 1;
+    if (arg_count > 1 && strcmp(args[1], "--inputs") == 0)
+    {
+        inputs = 2;
+        first = 2;
+    }
+    while (first < arg_count && strcmp(args[first], "--") != 0 && inputs > 0)
+    {
+        first++;
+    }
+    if (first < arg_count && strcmp(args[first], "--") == 0)
+    {
+        first++;
+    }
+    if (first >= arg_count)
+    {
+        fprintf(stderr, "Error: Invalid cache arguments\n");
+        return 1;
+    }
+    // Builtins and assignments change the shell itself (cd, export, source), a replay would skip that
+    int command = first;
+    while (command < arg_count && is_assignment(args[command]))
+    {
+        command++;
+    }
+    if (command == arg_count || is_builtin(args[command]))
+    {
+        fprintf(stderr, "Error: cache only runs external commands\n");
+        return 1;
+    }
+
+    // Key covers everything the command can see
+    CacheKey key = {14695981039346656037ULL, 7809847782465536322ULL};
+    for (int i = first; i < arg_count; i++)
+    {
+        cache_key_add(&key, args[i], strlen(args[i]) + 1);
+    }
+    for (int i = 0; i < local->envp_count; i++)
+    {
+        cache_key_add(&key, local->envp[i], strlen(local->envp[i]) + 1);
+    }
+    char path[PATH_MAX + 64];
+    if (getcwd(path, sizeof(path)) != NULL)
+    {
+        cache_key_add(&key, path, strlen(path) + 1);
+    }
+    for (int i = inputs; inputs > 0 && i < first - 1; i++)
+    {
+        if (cache_key_add_file(&key, args[i]) == -1)
+        {
+            fprintf(stderr, "Error: cache could not read input %s\n", args[i]);
+            return 1;
+        }
+    }
+
+    char dir[PATH_MAX];
+    if (cache_dir(local, dir, sizeof(dir)) == -1)
+    {
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/%016llx%016llx", dir, (unsigned long long)key.a, (unsigned long long)key.b);
+
+    // Hit: replay and mark the entry as just used
+    int exit_code;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        int hit = cache_replay(fd, &exit_code) == 0;
+        if (hit)
+        {
+            futimens(fd, NULL);
+        }
+        close(fd);
+        if (hit)
+        {
+            return exit_code;
+        }
+    }
+
+    // Miss: run normally with stdout/stderr in memory files
+    int out_fd = memfd_create("barber-cache-stdout", MFD_CLOEXEC);
+    int err_fd = memfd_create("barber-cache-stderr", MFD_CLOEXEC);
+    SavedFds saved;
+    saved.count = 0;
+    saved.pump = 0;
+    fflush(stdout);
+    if (out_fd == -1 || err_fd == -1 || redirect_fd(out_fd, STDOUT_FILENO, &saved) == -1 ||
+        redirect_fd(err_fd, STDERR_FILENO, &saved) == -1)
+    {
+        restore_redirect(&saved);
+        fprintf(stderr, "Error: cache could not set up output files\n");
+        if (out_fd >= 0)
+        {
+            close(out_fd);
+        }
+        if (err_fd >= 0)
+        {
+            close(err_fd);
+        }
+        return 1;
+    }
+    options.timed_out = 0;
+    exit_code = run_command(args + first, arg_count - first, local, history, prev_rc, file);
+    restore_redirect(&saved);
+
+    // Store under a temporary name, rename makes the entry appear whole
+    CacheHeader header = {CACHE_MAGIC, exit_code, lseek(out_fd, 0, SEEK_END), lseek(err_fd, 0, SEEK_END)};
+    char temp[PATH_MAX + 96];
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+    fd = options.timed_out ? -1 : open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0)
+    {
+        int stored = write_all(fd, &header, sizeof(header)) == 0 && copy_fd_range(out_fd, 0, header.out_len, fd) == 0 &&
+                     copy_fd_range(err_fd, 0, header.err_len, fd) == 0;
+        close(fd);
+        if (!stored || rename(temp, path) == -1)
+        {
+            unlink(temp);
+        }
+    }
+    copy_fd_range(out_fd, 0, header.out_len, STDOUT_FILENO);
+    copy_fd_range(err_fd, 0, header.err_len, STDERR_FILENO);
+    close(out_fd);
+    close(err_fd);
+
+    char *max_value = get_variable(local, "BARBER_CACHE_SIZE");
+    cache_evict(dir, max_value != NULL ? strtoull(max_value, NULL, 10) : CACHE_MAX_BYTES);
+    return exit_code;
+}
+
+// Helper Method: make pgrp the terminal's foreground group
+void take_terminal(pid_t pgrp)
+{
+    // Background groups get SIGTTOU for tcsetpgrp unless it is blocked
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    tcsetpgrp(STDIN_FILENO, pgrp);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// Helper Method: apply the ulimit settings in the child before exec
+void apply_limits(void)
+{
+    for (int i = 0; i < LIMIT_COUNT; i++)
+    {
+        if (options.limits[i] == RLIM_INFINITY)
+        {
+            continue;
+        }
+        struct rlimit limit = {options.limits[i], options.limits[i]};
+        if (setrlimit(limit_table[i].resource, &limit) == -1)
+        {
+            fprintf(stderr, "Error: could not set %s limit\n", limit_table[i].name);
+            exit(-1);
+        }
+    }
+}
+
+// Helper Method: exec command in child, searching path_value when it has no '/' (never returns)
+// https://linux.die.net/man/2/access
+void exec_command(char **args, char **envp, char *path_value)
+{
+    // Check check execute access of args
+    if (strchr(args[0], '/') != NULL || access(args[0], X_OK) == 0)
+    {
+        execve(args[0], args, envp);
+        exit(-1);
+    }
+    if (path_value == NULL)
+    {
+        exit(-1);
+    }
+
+    char *path = strdup(path_value);
+    if (path == NULL)
+    {
+        exit(-1);
+    }
+
+    // Split by :
+    char *token = strtok(path, ":");
+    while (token != NULL)
+    {
+        // Get path of token and arged func concated
+        char *new_path = malloc(strlen(token) + strlen(args[0]) + 2);
+        if (new_path == NULL)
+        {
+            exit(-1);
+        }
+
+        // dest, source: dest <-- dest + source
+        strcpy(new_path, token);
+        strcat(new_path, "/");
+        strcat(new_path, args[0]);
+
+        // Try access on new path
+        if (access(new_path, X_OK) == 0)
+        {
+            execve(new_path, args, envp);
+        }
+        free(new_path);
+        token = strtok(NULL, ":");
+    }
+    // No path found
+    exit(-1);
+}
+
+// Helper Method: fork and exec a command with optional stdout/stderr pipes (-1 to inherit)
+// A new process group lets a timeout reach everything the command started
+pid_t spawn_command(char **args, char **envp, char *path_value, int out_fd, int err_fd, int new_group, int foreground)
+{
+    // Picked before the fork so the round-robin position lives in the shell
+    int cpu = sched_next_cpu();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Child Process
+        if (new_group)
+        {
+            setpgid(0, 0);
+        }
+        if (foreground)
+        {
+            take_terminal(getpgrp());
+        }
+        if (out_fd >= 0)
+        {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        if (err_fd >= 0)
+        {
+            dup2(err_fd, STDERR_FILENO);
+        }
+        apply_limits();
+        apply_sched(cpu);
+        exec_command(args, envp, path_value);
+    }
+    if (pid > 0 && new_group)
+    {
+        // Set in both processes so neither order of events leaves a window
+        setpgid(pid, pid);
+    }
+    if (pid > 0 && options.trace.current != NULL)
+    {
+        options.trace.current->pid = pid;
+    }
+    return pid;
+}
+
+// Helper Method: copy word with every {} replaced by arg
+char *replace_placeholder(const char *word, const char *arg)
+{
+    size_t arg_len = strlen(arg);
+    size_t len = strlen(word);
+    for (const char *at = strstr(word, "{}"); at != NULL; at = strstr(at + 2, "{}"))
+    {
+        len += arg_len;
+    }
+    char *out = malloc(len + 1);
+    if (out == NULL)
+    {
+        return NULL;
+    }
+    char *dest = out;
+    const char *at;
+    while ((at = strstr(word, "{}")) != NULL)
+    {
+        memcpy(dest, word, at - word);
+        dest += at - word;
+        memcpy(dest, arg, arg_len);
+        dest += arg_len;
+        word = at + 2;
+    }
+    strcpy(dest, word);
+    return out;
+}
+
+// Helper Method: build a parallel job's NULL terminated argv, arg is appended when the template has no {}
+char **parallel_job_args(char **template, int template_count, const char *arg)
+{
+    char **job_args = calloc(template_count + 2, sizeof(char *));
+    if (job_args == NULL)
+    {
+        return NULL;
+    }
+    int replaced = 0;
+    int count = 0;
+    for (int i = 0; i < template_count; i++)
+    {
+        replaced |= strstr(template[i], "{}") != NULL;
+        job_args[count] = replace_placeholder(template[i], arg);
+        if (job_args[count++] == NULL)
+        {
+            replaced = 1;
+            break;
+        }
+    }
+    if (!replaced)
+    {
+        job_args[count++] = strdup(arg);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (job_args[i] == NULL)
+        {
+            for (int j = 0; j < count; j++)
+            {
+                free(job_args[j]);
+            }
+            free(job_args);
+            return NULL;
+        }
+    }
+    return job_args;
+}
+
+// Helper Method: start one parallel job in an idle pool slot and watch its pidfd and pipes
+int start_parallel_job(ParallelJob *job, int index, int epoll_fd, char **job_args, char **envp, char *path_value)
+{
+    int out_pipe[2] = {-1, -1};
+    int err_pipe[2] = {-1, -1};
+    if (pipe2(out_pipe, O_CLOEXEC) == -1 || pipe2(err_pipe, O_CLOEXEC) == -1)
+    {
+        fprintf(stderr, "Error: could not start job %s\n", job_args[0]);
+        if (out_pipe[0] >= 0)
+        {
+            close(out_pipe[0]);
+            close(out_pipe[1]);
+        }
+        return -1;
+    }
+
+    pid_t pid = spawn_command(job_args, envp, path_value, out_pipe[1], err_pipe[1], options.cmd_timeout_ns > 0, 0);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    int pidfd = pid > 0 ? pidfd_open(pid, 0) : -1;
+    if (pidfd == -1)
+    {
+        fprintf(stderr, "Error: could not start job %s\n", job_args[0]);
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        if (pid > 0)
+        {
+            waitpid(pid, NULL, 0);
+        }
+        return -1;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->pid = pid;
+    job->fds[0] = pidfd;
+    job->fds[1] = out_pipe[0];
+    job->fds[2] = err_pipe[0];
+    job->deadline = options.cmd_timeout_ns > 0 ? monotonic_ns() + options.cmd_timeout_ns : 0;
+    for (int slot = 0; slot < 3; slot++)
+    {
+        struct epoll_event event = {EPOLLIN, {.u32 = index * 3 + slot}};
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, job->fds[slot], &event);
+        job->open_count++;
+    }
+    return 0;
+}
+
+// Helper Method: handle one ready pidfd or pipe of a job, returns 1 once the job has exited and its pipes closed
+int service_parallel_job(ParallelJob *job, int slot, int epoll_fd)
+{
+    ssize_t n = 0;
+    if (slot == 0)
+    {
+        wait_reap(job->pid, &job->status);
+    }
+    else
+    {
+        // A full buffer moves to the job's memory file, so only a bounded part of a large output stays on the heap
+        if (job->output_len[slot] >= PARALLEL_SPILL_BYTES)
+        {
+            if (job->spill[slot] == 0)
+            {
+                job->spill[slot] = move_fd_high(memfd_create("barber-parallel", MFD_CLOEXEC));
+            }
+            if (job->spill[slot] < 0 || write_all(job->spill[slot], job->output[slot], job->output_len[slot]) == -1)
+            {
+                fprintf(stderr, "Error: parallel could not buffer job output\n");
+                kill(job->pid, SIGKILL);
+                n = -1;
+            }
+            job->output_len[slot] = 0;
+        }
+        // Grow the group buffer so a read always has room
+        if (n == 0 && job->output_cap[slot] - job->output_len[slot] < 65536)
+        {
+            size_t cap = job->output_cap[slot] * 2 + 65536;
+            char *grown = realloc(job->output[slot], cap);
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Error: parallel could not buffer job output\n");
+                kill(job->pid, SIGKILL);
+                n = -1;
+            }
+            else
+            {
+                job->output[slot] = grown;
+                job->output_cap[slot] = cap;
+            }
+        }
+        if (n == 0)
+        {
+            n = read(job->fds[slot], job->output[slot] + job->output_len[slot], 65536);
+        }
+    }
+    if (n > 0)
+    {
+        job->output_len[slot] += n;
+        return 0;
+    }
+    if (slot != 0 && n < 0 && errno == EINTR)
+    {
+        return 0;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, job->fds[slot], NULL);
+    close(job->fds[slot]);
+    job->fds[slot] = -1;
+    return --job->open_count == 0;
+}
+
+// Helper Method: write a finished job's grouped output, free the slot and return the job's exit code
+int finish_parallel_job(ParallelJob *job)
+{
+    for (int slot = STDOUT_FILENO; slot <= STDERR_FILENO; slot++)
+    {
+        // Spilled output goes first, read back in chunks
+        off_t spilled = job->spill[slot] > 0 ? lseek(job->spill[slot], 0, SEEK_CUR) : 0;
+        char buf[65536];
+        for (off_t offset = 0; offset < spilled;)
+        {
+            ssize_t n = pread(job->spill[slot], buf, sizeof(buf), offset);
+            if (n <= 0)
+            {
+                break;
+            }
+            if (options.capture_dir != NULL)
+            {
+                capture_chunk(&options.capture, options.line_number, slot, buf, n);
+            }
+            write_all(slot, buf, n);
+            offset += n;
+        }
+        if (job->spill[slot] > 0)
+        {
+            close(job->spill[slot]);
+        }
+        if (job->output_len[slot] > 0)
+        {
+            if (options.capture_dir != NULL)
+            {
+                capture_chunk(&options.capture, options.line_number, slot, job->output[slot], job->output_len[slot]);
+            }
+            write_all(slot, job->output[slot], job->output_len[slot]);
+        }
+        free(job->output[slot]);
+    }
+    int rc = WIFEXITED(job->status) ? WEXITSTATUS(job->status) : 128 + WTERMSIG(job->status);
+    if (job->timed_out)
+    {
+        rc = TIMEOUT_STATUS;
+    }
+    memset(job, 0, sizeof(*job));
+    return rc;
+}
+
+// Helper Method: run count prepared commands with up to jobs at once, handing the next one to whichever job finishes
+// first, returns the number that failed and sets worst_rc to the highest exit code
+int run_parallel_jobs(char ***job_args, int count, long jobs, int progress, char **envp, char *path_value, int *worst_rc)
+{
+    ParallelJob *pool = calloc(jobs, sizeof(ParallelJob));
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool == NULL || epoll_fd == -1)
+    {
+        fprintf(stderr, "Error: could not set up job pool\n");
+        free(pool);
+        if (epoll_fd >= 0)
+        {
+            close(epoll_fd);
+        }
+        *worst_rc = 1;
+        return count;
+    }
+
+    fflush(stdout);
+    int next = 0;
+    int running = 0;
+    int done = 0;
+    int failed = 0;
+    while (next < count || running > 0)
+    {
+        // Hand out inputs to idle slots
+        for (int j = 0; j < jobs && next < count; j++)
+        {
+            if (pool[j].pid != 0)
+            {
+                continue;
+            }
+            if (start_parallel_job(&pool[j], j, epoll_fd, job_args[next++], envp, path_value) == 0)
+            {
+                running++;
+            }
+            else
+            {
+                *worst_rc = *worst_rc > 1 ? *worst_rc : 1;
+                failed++;
+                done++;
+            }
+        }
+        if (running == 0)
+        {
+            continue;
+        }
+
+        // Escalate overdue jobs and sleep until the nearest deadline
+        long long now = monotonic_ns();
+        int wait_ms = -1;
+        for (int j = 0; j < jobs; j++)
+        {
+            ParallelJob *job = &pool[j];
+            if (job->pid == 0 || job->deadline == 0)
+            {
+                continue;
+            }
+            if (job->deadline <= now)
+            {
+                kill(-job->pid, job->timed_out ? SIGKILL : SIGTERM);
+                job->deadline = job->timed_out ? 0 : now + options.kill_after_ns;
+                job->timed_out = 1;
+            }
+            if (job->deadline > 0)
+            {
+                int left_ms = (int)((job->deadline - now + 999999) / 1000000);
+                wait_ms = wait_ms == -1 || left_ms < wait_ms ? left_ms : wait_ms;
+            }
+        }
+
+        struct epoll_event events[64];
+        int ready = epoll_wait(epoll_fd, events, 64, wait_ms);
+        for (int i = 0; i < ready; i++)
+        {
+            ParallelJob *job = &pool[events[i].data.u32 / 3];
+            if (job->pid == 0 || !service_parallel_job(job, events[i].data.u32 % 3, epoll_fd))
+            {
+                continue;
+            }
+            if (progress == 2)
+            {
+                // Clear the progress line before the job's output
+                fprintf(stderr, "\r\033[K");
+            }
+            int rc = finish_parallel_job(job);
+            failed += rc != 0;
+            *worst_rc = rc > *worst_rc ? rc : *worst_rc;
+            running--;
+            done++;
+            if (progress)
+            {
+                fprintf(stderr, "%sparallel: %d/%d done, %d running, %d failed%s", progress == 2 ? "\r" : "", done,
+                        count, running, failed, progress == 2 ? "" : "\n");
+            }
+        }
+    }
+    if (progress == 2 && count > 0)
+    {
+        fprintf(stderr, "\n");
+    }
+    close(epoll_fd);
+    free(pool);
+    return failed;
+}
+
+// Usage: parallel [-j N] [--progress] command [args...] [::: inputs...]
+// Runs command once per input ({} is replaced by the input, or it is appended), inputs are stdin lines without :::
+// Keeps N jobs running, handing the next input to whichever job finishes first
+int built_in_parallel(char **args, int arg_count, LocalVariableList *local)
+{
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int progress = 0;
+    int first = 1;
+    while (first < arg_count && args[first][0] == '-')
+    {
+        if (strcmp(args[first], "-j") == 0 && first + 1 < arg_count)
+        {
+            char *end;
+            jobs = strtol(args[first + 1], &end, 10);
+            if (*end != '\0' || jobs < 1 || jobs > MAXPARALLEL)
+            {
+                fprintf(stderr, "Error: parallel job count must be 1 to %d\n", MAXPARALLEL);
+                return 1;
+            }
+            first += 2;
+        }
+        else if (strcmp(args[first], "--progress") == 0)
+        {
+            // A terminal gets one updating line, anything else a line per finished job
+            progress = isatty(STDERR_FILENO) ? 2 : 1;
+            first++;
+        }
+        else
+        {
+            break;
+        }
+    }
+    int separator = first;
+    while (separator < arg_count && strcmp(args[separator], ":::") != 0)
+    {
+        separator++;
+    }
+    if (separator == first)
+    {
+        fprintf(stderr, "Error: Invalid parallel arguments\n");
+        return 1;
+    }
+
+    // Collect inputs up front so progress knows the total
+    GlobMatches inputs = {NULL, 0, 0};
+    int ok = 1;
+    if (separator < arg_count)
+    {
+        for (int i = separator + 1; i < arg_count && ok; i++)
+        {
+            ok = add_glob_match(&inputs, args[i]);
+        }
+    }
+    else
+    {
+        char *line = NULL;
+        size_t line_cap = 0;
+        ssize_t line_len;
+        while (ok && (line_len = getline(&line, &line_cap, stdin)) != -1)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            if (line[0] != '\0')
+            {
+                ok = add_glob_match(&inputs, line);
+            }
+        }
+        free(line);
+        clearerr(stdin);
+    }
+    // Expand the template for every input up front
+    char ***job_args = calloc(inputs.count + 1, sizeof(char **));
+    for (int i = 0; job_args != NULL && i < inputs.count && ok; i++)
+    {
+        job_args[i] = parallel_job_args(args + first, separator - first, inputs.paths[i]);
+        ok = job_args[i] != NULL;
+    }
+    if (!ok || job_args == NULL)
+    {
+        fprintf(stderr, "Error: parallel could not set up jobs\n");
+        ok = 0;
+    }
+
+    int failed = 1;
+    int worst_rc = 0;
+    if (ok)
+    {
+        uint64_t capture_offset = options.capture.offset;
+        int64_t capture_start = realtime_ns();
+        long long start_ns = monotonic_ns();
+        failed = run_parallel_jobs(job_args, inputs.count, jobs, progress, local->envp, get_variable(local, "PATH"), &worst_rc);
+        options.profile.child_wall_ns += monotonic_ns() - start_ns;
+        failed = failed < PARALLEL_FAILED_MAX ? failed : PARALLEL_FAILED_MAX;
+        if (options.capture_dir != NULL)
+        {
+            capture_index(&options.capture, options.line_number, failed, 0, capture_offset, capture_start);
+        }
+    }
+    for (int i = 0; job_args != NULL && job_args[i] != NULL; i++)
+    {
+        for (int j = 0; job_args[i][j] != NULL; j++)
+        {
+            free(job_args[i][j]);
+        }
+        free(job_args[i]);
+    }
+    free(job_args);
+    free_glob_matches(&inputs);
+    return failed;
+}
+
+// Helper Method: add one inotify watch (name NULL for a whole directory), returns the watch descriptor or -1
+int watch_add(Watcher *watcher, const char *path, const char *name, uint32_t mask)
+{
+    if (watcher->count == watcher->cap)
+    {
+        int cap = watcher->cap ? watcher->cap * 2 : 16;
+        WatchTarget *grown = realloc(watcher->targets, sizeof(WatchTarget) * cap);
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        watcher->targets = grown;
+        watcher->cap = cap;
+    }
+    int wd = inotify_add_watch(watcher->inotify_fd, path, mask);
+    if (wd < 0)
+    {
+        return -1;
+    }
+    WatchTarget *target = &watcher->targets[watcher->count];
+    target->wd = wd;
+    target->path = strdup(path);
+    target->name = name != NULL ? strdup(name) : NULL;
+    if (target->path == NULL || (name != NULL && target->name == NULL))
+    {
+        free(target->path);
+        free(target->name);
+        return -1;
+    }
+    watcher->count++;
+    return wd;
+}
+
+// Helper Method: check if an entry name matches one of the watch --exclude patterns
+int watch_excluded(Watcher *watcher, const char *name)
+{
+    for (int i = 0; i < watcher->exclude_count; i++)
+    {
+        if (glob_match(watcher->excludes[i], name))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper Method: watch a directory and every directory below it (hidden, excluded ones and symlinks skipped)
+// A file is watched through its parent directory, so editors that save by rename keep being seen
+int watch_add_tree(Watcher *watcher, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1)
+    {
+        fprintf(stderr, "Error: watch cannot access %s\n", path);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode))
+    {
+        char *copy = strdup(path);
+        if (copy == NULL)
+        {
+            return -1;
+        }
+        char *slash = strrchr(copy, '/');
+        const char *dir = slash == NULL ? "." : slash == copy ? "/" : copy;
+        if (slash != NULL)
+        {
+            *slash = '\0';
+        }
+        int wd = watch_add(watcher, dir, slash != NULL ? slash + 1 : path, WATCH_EVENTS | IN_ONLYDIR);
+        free(copy);
+        return wd < 0 ? -1 : 0;
+    }
+
+    // A directory reached twice (bind mounts, a path given twice) gets the same descriptor, stop there
+    int wd = inotify_add_watch(watcher->inotify_fd, path, WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+    for (int i = 0; wd >= 0 && i < watcher->count; i++)
+    {
+        if (watcher->targets[i].wd == wd && watcher->targets[i].name == NULL)
+        {
+            return 0;
+        }
+    }
+    if (wd < 0 || watch_add(watcher, path, NULL, WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW) < 0)
+    {
+        fprintf(stderr, "Error: watch cannot add %s\n", path);
+        return -1;
+    }
+    DirListing *listing = read_dir_listing(path);
+    if (listing == NULL)
+    {
+        return 0;
+    }
+    int rc = 0;
+    for (int i = 0; i < listing->count && rc == 0; i++)
+    {
+        if (listing->names[i][0] == '.' || (listing->types[i] != DT_DIR && listing->types[i] != DT_UNKNOWN) ||
+            watch_excluded(watcher, listing->names[i]))
+        {
+            continue;
+        }
+        char *child = join_glob_path(path, listing->names[i]);
+        struct stat child_st;
+        if (child != NULL && lstat(child, &child_st) == 0 && S_ISDIR(child_st.st_mode))
+        {
+            rc = watch_add_tree(watcher, child);
+        }
+        free(child);
+    }
+    free_dir_listing(listing);
+    return rc;
+}
+
+// Helper Method: read pending events, new directories are watched as they appear
+// Returns whether any watched file changed
+int watch_read_events(Watcher *watcher)
+{
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t len;
+    while ((len = read(watcher->inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *ptr = buf; ptr < buf + len;)
+        {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+            for (int i = watcher->count - 1; i >= 0; i--)
+            {
+                WatchTarget *target = &watcher->targets[i];
+                if (target->wd != event->wd)
+                {
+                    continue;
+                }
+                // Watch is gone (directory removed), forget it
+                if (event->mask & IN_IGNORED)
+                {
+                    free(target->path);
+                    free(target->name);
+                    watcher->targets[i] = watcher->targets[--watcher->count];
+                    continue;
+                }
+                if (target->name != NULL ? event->len == 0 || strcmp(event->name, target->name) != 0
+                                         : event->len > 0 && (event->name[0] == '.' || watch_excluded(watcher, event->name)))
+                {
+                    continue;
+                }
+                changed = 1;
+                if (target->name == NULL && (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+                {
+                    char *child = join_glob_path(target->path, event->name);
+                    if (child != NULL)
+                    {
+                        watch_add_tree(watcher, child);
+                        free(child);
+                    }
+                    // watch_add_tree may have moved the targets
+                    break;
+                }
+            }
+        }
+    }
+    return changed;
+}
+
+// Usage: watch [--debounce MS] [--exclude=PATTERN]... PATHS... -- command [args...]
+// Runs command, then again each time something under PATHS changes, bursts within MS coalesce into one run
+// Sleeps in poll between changes, entries matching an --exclude pattern (the command's own outputs) are not counted
+// The pattern shares a word with the flag, a glob on its own would be expanded before watch sees it
+int built_in_watch(char **args, int arg_count, LocalVariableList *local, History *history, int prev_rc, FILE *file)
+{
+    long long debounce_ms = WATCH_DEBOUNCE_MS;
+    Watcher watcher = {-1, NULL, 0, 0, malloc(sizeof(char *) * arg_count), 0};
+    if (watcher.excludes == NULL)
+    {
+        return 1;
+    }
+    int first = 1;
+    while (first + 1 < arg_count && (strcmp(args[first], "--debounce") == 0 || strncmp(args[first], "--exclude=", 10) == 0))
+    {
+        if (strncmp(args[first], "--exclude=", 10) == 0)
+        {
+            watcher.excludes[watcher.exclude_count++] = args[first] + 10;
+            first++;
+            continue;
+        }
+        char *end;
+        debounce_ms = strtoll(args[first + 1], &end, 10);
+        if (*end != '\0' || debounce_ms < 0)
+        {
+            fprintf(stderr, "Error: invalid debounce %s\n", args[first + 1]);
+            free(watcher.excludes);
+            return 1;
+        }
+        first += 2;
+    }
+    int separator = first;
+    while (separator < arg_count && strcmp(args[separator], "--") != 0)
+    {
+        separator++;
+    }
+    if (separator == first || separator + 1 >= arg_count)
+    {
+        fprintf(stderr, "Error: Usage: watch [--debounce MS] [--exclude=PATTERN]... PATHS... -- command\n");
+        free(watcher.excludes);
+        return 1;
+    }
+
+    watcher.inotify_fd = move_fd_high(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    int rc = watcher.inotify_fd < 0 ? 1 : 0;
+    for (int i = first; i < separator && rc == 0; i++)
+    {
+        rc = watch_add_tree(&watcher, args[i]) == -1;
+    }
+
+    // The command line after -- runs like any other line, the watch line's redirect already applies
+    Redirect none = {NULL, NR, -1, NULL, 0};
+    while (rc == 0)
+    {
+        prev_rc = handle_command(args + separator + 1, arg_count - separator - 1, &none, local, history, prev_rc, file);
+        fflush(stdout);
+
+        // A change made while the command ran leads to one more run, after the debounce like any other
+        // Block until the first change, then until the tree stays quiet for the debounce period
+        int changed = watch_read_events(&watcher);
+        struct pollfd pfd = {watcher.inotify_fd, POLLIN, 0};
+        while (!changed && watcher.count > 0)
+        {
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            {
+                break;
+            }
+            changed = watch_read_events(&watcher);
+        }
+        while (changed && poll(&pfd, 1, (int)debounce_ms) > 0)
+        {
+            watch_read_events(&watcher);
+        }
+        if (!changed)
+        {
+            fprintf(stderr, "Error: watch has nothing left to watch\n");
+            rc = 1;
+        }
+    }
+
+    for (int i = 0; i < watcher.count; i++)
+    {
+        free(watcher.targets[i].path);
+        free(watcher.targets[i].name);
+    }
+    free(watcher.targets);
+    free(watcher.excludes);
+    if (watcher.inotify_fd >= 0)
+    {
+        close(watcher.inotify_fd);
+    }
+    return rc;
+}
+
+// Usage: exec N>file, N>>file, N<file, N>&M, N<&M, N>&- or N<&- (N below EXEC_MAXFD)
+// Descriptors stay open in the shell and are inherited by every command that follows
+int built_in_exec(char **args, int arg_count)
+{
+    if (arg_count < 2)
+    {
+        fprintf(stderr, "Error: Invalid exec arguments\n");
+        return 1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 1; i < arg_count; i++)
+    {
+        char *word = args[i];
+        char *op = word + strspn(word, "0123456789");
+        if (*op != '<' && *op != '>')
+        {
+            fprintf(stderr, "Error: exec only takes redirects, not %s\n", word);
+            return 1;
+        }
+        int fd = op > word ? atoi(word) : *op == '<' ? STDIN_FILENO : STDOUT_FILENO;
+        int flags = *op == '<' ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+        char *target = op + 1;
+        if (*op == '>' && *target == '>')
+        {
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+            target++;
+        }
+        if (fd >= EXEC_MAXFD || op - word > 1)
+        {
+            fprintf(stderr, "Error: exec descriptors must be below %d\n", EXEC_MAXFD);
+            return 1;
+        }
+        // Journaled with the settings, so --resume opens it again
+        options.exec_fds |= 1u << fd;
+        options.settings_generation++;
+        if (target[0] == '&')
+        {
+            // N>&- closes, N>&M duplicates
+            if (strcmp(target + 1, "-") == 0)
+            {
+                close(fd);
+                continue;
+            }
+            int from = parse_fd_word(target + 1);
+            if (from < 0 || (from != fd && dup2(from, fd) == -1))
+            {
+                fprintf(stderr, "Error: bad descriptor %s\n", target + 1);
+                return 1;
+            }
+            continue;
+        }
+        int opened = open(target, flags, 0644);
+        if (opened == -1)
+        {
+            fprintf(stderr, "Error: could not open file %s\n", target);
+            return 1;
+        }
+        if (opened != fd)
+        {
+            dup2(opened, fd);
+            close(opened);
+        }
+    }
+    return 0;
+}
+
+// Helper Method: move len bytes from pipe into *to, a target that fails is switched to devnull so the others keep going
+// Targets without splice support (some character devices) are copied through a buffer instead
+void fanout_drain(int from, int *to, size_t len, int devnull)
+{
+    while (len > 0)
+    {
+        ssize_t n = splice(from, NULL, *to, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && errno == EINVAL && *to != devnull)
+        {
+            char buf[65536];
+            n = read(from, buf, len < sizeof(buf) ? len : sizeof(buf));
+            if (n > 0 && write_all(*to, buf, n) == -1)
+            {
+                *to = devnull;
+            }
+        }
+        else if (n < 0 && *to != devnull)
+        {
+            *to = devnull;
+            continue;
+        }
+        if (n <= 0)
+        {
+            return;
+        }
+        len -= n;
+    }
+}
+
+// Helper Method: copy everything arriving on in to every target without it passing through user space
+// tee(2) hands each extra target the pipe's pages through a pipe of its own, the last target consumes them with splice(2)
+int fanout_pump(int in, int *targets, int count)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int size = fcntl(in, F_GETPIPE_SZ);
+    int pipes[MAXREDIRECTS][2];
+    for (int i = 0; i < count - 1; i++)
+    {
+        // Same size as the input so a tee into a drained pipe always takes everything the first one took
+        if (pipe2(pipes[i], O_CLOEXEC) == -1)
+        {
+            return 1;
+        }
+        fcntl(pipes[i][1], F_SETPIPE_SZ, size);
+    }
+    while (1)
+    {
+        ssize_t n = tee(in, pipes[0][1], size, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        fanout_drain(pipes[0][0], &targets[0], n, devnull);
+        for (int i = 1; i < count - 1; i++)
+        {
+            ssize_t copied;
+            while ((copied = tee(in, pipes[i][1], n, 0)) < 0 && errno == EINTR)
+            {
+            }
+            if (copied != n)
+            {
+                // A partial copy cannot be completed without consuming the input, this target stops here
+                targets[i] = devnull;
+            }
+            fanout_drain(pipes[i][0], &targets[i], copied > 0 ? copied : 0, devnull);
+        }
+        fanout_drain(in, &targets[count - 1], n, devnull);
+    }
+    return 0;
+}
+
+// Helper Method: point a descriptor at a pipe whose contents a pump process copies to every target word
+int apply_fanout(Redirect *redirect, SavedFds *saved)
+{
+    int targets[MAXREDIRECTS];
+    int count = 0;
+    int rc = 0;
+    for (int i = 0; i < redirect->word_count && rc == 0; i++)
+    {
+        char *sign = strchr(redirect->words[i], '>');
+        int append = sign[1] == '>';
+        char *file_name = sign + 1 + append;
+        if (file_name[0] == '&')
+        {
+            int from = parse_fd_word(file_name + 1);
+            targets[count] = from >= 0 ? fcntl(from, F_DUPFD_CLOEXEC, EXEC_MAXFD) : -1;
+        }
+        else
+        {
+            // splice(2) refuses O_APPEND files, fanout_drain copies into those through a buffer
+            // so writers appending to the same file at the same time are not overwritten
+            targets[count] = open(file_name, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+        }
+        if (targets[count] == -1)
+        {
+            fprintf(stderr, "Error: could not open file %s\n", file_name);
+            rc = 1;
+            break;
+        }
+        count++;
+    }
+
+    int pipe_fds[2] = {-1, -1};
+    if (rc == 0 && pipe2(pipe_fds, O_CLOEXEC) == -1)
+    {
+        fprintf(stderr, "Error: could not create fan-out pipe\n");
+        rc = 1;
+    }
+    if (rc == 0)
+    {
+        saved->pump = fork();
+        if (saved->pump == 0)
+        {
+            close(pipe_fds[1]);
+            _exit(fanout_pump(pipe_fds[0], targets, count));
+        }
+        if (saved->pump < 0 || redirect_fd(pipe_fds[1], redirect_word_fd(redirect->last_arg), saved) == -1)
+        {
+            fprintf(stderr, "Error: could not change fd\n");
+            rc = 1;
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        close(targets[i]);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (pipe_fds[i] >= 0)
+        {
+            close(pipe_fds[i]);
+        }
+    }
+    if (saved->pump < 0)
+    {
+        saved->pump = 0;
+    }
+    return rc;
+}
+
+// Helper Method: apply the line's redirect, saving replaced fds in saved
+int apply_redirect(Redirect *redirect, SavedFds *saved)
+{
+    int fd;
+    // Pending output belongs to the old target
+    fflush(stdout);
+    fflush(stderr);
+    if ((redirect->redirect_type == RO || redirect->redirect_type == ARO) && redirect->word_count > 1)
+    {
+        return apply_fanout(redirect, saved);
+    }
+    switch(redirect->redirect_type)
+    {
+        case NR: {
+            // No Redirecting
+            break;
+        }
+        case RI: {
+            // Get sign pointer
+            char *arg_copy = strdup(redirect->last_arg);
+            if (arg_copy == NULL)
+            {
+                return 1;
+            }
+            char *sign = strchr(arg_copy, '<');
+
+            // Get file pointer
+            char *file_name = sign + 1;
+
+            // Attempt to find an n
+            int new_fd = STDIN_FILENO;
+
+            if (sign != NULL)
+            {
+                *sign = '\0';
+                int parse = atoi(arg_copy);
+                if (parse != 0)
+                {
+                    new_fd = parse;
+                }
+            }
+
+            // <&N reads from a descriptor already open (exec N<file)
+            if (file_name[0] == '&')
+            {
+                if (redirect_fd(parse_fd_word(file_name + 1), new_fd, saved) == -1)
+                {
+                    fprintf(stderr, "Error: bad descriptor %s\n", file_name + 1);
+                    free(arg_copy);
+                    return 1;
+                }
+                free(arg_copy);
+                break;
+            }
+
+            // Access
+            fd = move_fd_high(open(file_name, O_RDONLY | O_CLOEXEC));
+            if (fd == -1)
+            {
+                fprintf(stderr, "Error: could not open file\n");
+                free(arg_copy);
+                return 1;
+            }
+            if (redirect_fd(fd, new_fd, saved) == -1)
+            {
+                fprintf(stderr, "Error: could not change fd\n");
+                close(fd);
+                free(arg_copy);
+                return 1;
+            }
+            close(fd);
+            free(arg_copy);
+            break;
+        }
+        case RO: {
+            // Get sign pointer
+            char *arg_copy = strdup(redirect->last_arg);
+            if (arg_copy == NULL)
+            {
+                return 1;
+            }
+            char *sign = strchr(arg_copy, '>');
+
+            // Get file pointer
+            char *file_name = sign + 1;
+
+            // Attempt to find an n
+            int new_fd = STDOUT_FILENO;
+            if (sign != NULL)
+            {
+                *sign = '\0';
+                int parse = atoi(arg_copy);
+                if (parse != 0)
+                {
+                    new_fd = parse;
+                }
+            }
+
+            // >&N writes to a descriptor already open (exec N>>file, 2>&1)
+            if (file_name[0] == '&')
+            {
+                if (redirect_fd(parse_fd_word(file_name + 1), new_fd, saved) == -1)
+                {
+                    fprintf(stderr, "Error: bad descriptor %s\n", file_name + 1);
+                    free(arg_copy);
+                    return 1;
+                }
+                free(arg_copy);
+                break;
+            }
+
+            // Access
+            fd = move_fd_high(open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+
+            if (fd == -1)
+            {
+                fprintf(stderr, "Error: could not open file\n");
+                free(arg_copy);
+                return 1;
+            }
+            if (redirect_fd(fd, new_fd, saved) == -1)
+            {
+                fprintf(stderr, "Error: could not change fd\n");
+                close(fd);
+                free(arg_copy);
+                return 1;
+            }
+            close(fd);
+            free(arg_copy);
+            break;
+        }
+        case ARO: {
+            // Get sign pointer
+            char *arg_copy = strdup(redirect->last_arg);
+            if (arg_copy == NULL)
+            {
+                return 1;
+            }
+            char *sign = strchr(arg_copy, '>');
+
+            // Get file pointer
+            char *file_name = sign + 2;
+
+            // Attempt to find an n
+            int new_fd = STDOUT_FILENO;
+            if (sign != NULL)
+            {
+                *sign = '\0';
+                int parse = atoi(arg_copy);
+                if (parse != 0)
+                {
+                    new_fd = parse;
+                }
+            }
+
+            // Access (repeated appends can reuse a cached descriptor)
+            int cached;
+            fd = open_redirect_target(file_name, O_WRONLY | O_CREAT | O_APPEND, &cached);
+            if (fd == -1)
+            {
+                fprintf(stderr, "Error: could not open file\n");
+                free(arg_copy);
+                return 1;
+            }
+            if (redirect_fd(fd, new_fd, saved) == -1)
+            {
+                fprintf(stderr, "Error: could not change fd\n");
+                if (!cached)
+                {
+                    close(fd);
+                }
+                free(arg_copy);
+                return 1;
+            }
+            if (!cached)
+            {
+                close(fd);
+            }
+            free(arg_copy);
+            break;
+        }
+        case RSOSE: {
+            // Get sign pointer
+            char *arg_copy = strdup(redirect->last_arg);
+            if (arg_copy == NULL)
+            {
+                return 1;
+            }
+            char *sign = strchr(arg_copy, '&');
+
+            // Get file pointer
+            char *file_name = sign + 2;
+
+            // Access
+            fd = move_fd_high(open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+            if (fd == -1)
+            {
+                fprintf(stderr, "Error: could not open file\n");
+                free(arg_copy);
+                return 1;
+            }
+            if (redirect_fd(fd, STDOUT_FILENO, saved) == -1 || redirect_fd(fd, STDERR_FILENO, saved) == -1)
+            {
+                fprintf(stderr, "Error: could not change fd\n");
+                close(fd);
+                free(arg_copy);
+                return 1;
+            }
+            close(fd);
+            free(arg_copy);
+            break;
+        }
+        case ASOSE: {
+            // Get sign pointer
+            char *arg_copy = strdup(redirect->last_arg);
+            if (arg_copy == NULL)
+            {
+                return 1;
+            }
+            char *sign = strchr(arg_copy, '&');
+
+            // Get file pointer
+            char *file_name = sign + 3;
+
+            // Access (repeated appends can reuse a cached descriptor)
+            int cached;
+            fd = open_redirect_target(file_name, O_WRONLY | O_CREAT | O_APPEND, &cached);
+            if (fd == -1)
+            {
+                fprintf(stderr, "Error: could not open file\n");
+                free(arg_copy);
+                return 1;
+            }
+            if (redirect_fd(fd, STDOUT_FILENO, saved) == -1 || redirect_fd(fd, STDERR_FILENO, saved) == -1)
+            {
+                fprintf(stderr, "Error: could not change fd\n");
+                if (!cached)
+                {
+                    close(fd);
+                }
+                free(arg_copy);
+                return 1;
+            }
+            if (!cached)
+            {
+                close(fd);
+            }
+            free(arg_copy);
+            break;
+        }
+        case HD:
+        case HS: {
+            // Body was read into a memfd when the line was parsed, only the fd number is left
+            int new_fd = STDIN_FILENO;
+            int parse = atoi(redirect->last_arg);
+            if (parse != 0)
+            {
+                new_fd = parse;
+            }
+            if (redirect->body_fd < 0 || redirect_fd(redirect->body_fd, new_fd, saved) == -1)
+            {
+                fprintf(stderr, "Error: could not change fd\n");
+                return 1;
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "Error: handling redirects\n");
+            return 1;
+    }
+
+    return 0;
+}
+
+// Helper Method: fork, exec and wait for an external command (capture, timeout and limits applied)
+int run_external(char **args, char **envp, char *path_value)
+{
+    // Capture mode reads the child's stdout/stderr through pipes
+    int out_pipe[2] = {-1, -1};
+    int err_pipe[2] = {-1, -1};
+    if (options.capture_dir != NULL && (pipe2(out_pipe, O_CLOEXEC) == -1 || pipe2(err_pipe, O_CLOEXEC) == -1))
+    {
+        fprintf(stderr, "Error: could not create capture pipes\n");
+        if (out_pipe[0] >= 0)
+        {
+            close(out_pipe[0]);
+            close(out_pipe[1]);
+        }
+        return 1;
+    }
+    uint64_t capture_offset = options.capture.offset;
+    int64_t capture_start = realtime_ns();
+    long long timeout_ns = options.cmd_timeout_ns;
+    pid_t shell_group = getpgrp();
+    int foreground = timeout_ns > 0 && isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == shell_group;
+
+    // Create fork to exec command
+    int status;
+    pid_t rc, w;
+    long long spawn_ns = monotonic_ns();
+    rc = spawn_command(args, envp, path_value, out_pipe[1], err_pipe[1], timeout_ns > 0, foreground);
+    if (rc < 0)
+    {
+        // Fork failed
+        fprintf(stderr, "Error: Fork failed\n");
+        if (out_pipe[0] >= 0)
+        {
+            close(out_pipe[0]);
+            close(out_pipe[1]);
+            close(err_pipe[0]);
+            close(err_pipe[1]);
+        }
+        return 1;
+    }
+    if (out_pipe[0] >= 0)
+    {
+        close(out_pipe[1]);
+        close(err_pipe[1]);
+    }
+    if (foreground)
+    {
+        take_terminal(rc);
+    }
+
+    // Parent Process
+    // https://stackoverflow.com/questions/47441871/why-should-we-check-wifexited-after-wait-in-order-to-kill-child-processes-in-lin
+    w = wait_child(rc, out_pipe[0], err_pipe[0], timeout_ns, &status);
+    options.profile.child_wall_ns += monotonic_ns() - spawn_ns;
+    if (foreground)
+    {
+        take_terminal(shell_group);
+    }
+    if (w == -1)
+    {
+        // Waitpid failure
+        fprintf(stderr, "Error: waitpid failure\n");
+        return 1;
+    }
+    if (options.capture_dir != NULL)
+    {
+        int exit_code = w ? TIMEOUT_STATUS : WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        capture_index(&options.capture, options.line_number, exit_code, w ? CAPTURE_TIMED_OUT : 0, capture_offset, capture_start);
+    }
+    if (w)
+    {
+        options.timed_out = 1;
+        fprintf(stderr, "Error: %s timed out\n", args[0]);
+        return TIMEOUT_STATUS;
+    }
+    if (WIFEXITED(status))
+    {
+        // Succesful child exit
+        int child_rc = WEXITSTATUS(status);
+        return child_rc;
+    }
+    else
+    {
+        // Failed child exit (a writer whose reader went away, as in head <(yes), is not worth reporting)
+        if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGPIPE)
+        {
+            fprintf(stderr, "Error: Child process failed exit\n");
+        }
+        return 1;
+    }
+}
+
+// Helper Method: bytes a NULL terminated string array takes in execve's argument space
+size_t arg_list_size(char **list)
+{
+    size_t size = sizeof(char *);
+    for (int i = 0; list[i] != NULL; i++)
+    {
+        size += strlen(list[i]) + 1 + sizeof(char *);
+    }
+    return size;
+}
+
+// Helper Method: argv plus envp bytes execve accepts, less headroom as in xargs
+size_t arg_limit(void)
+{
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= ARGSPLIT_HEADROOM)
+    {
+        arg_max = _POSIX_ARG_MAX;
+    }
+    return arg_max - ARGSPLIT_HEADROOM;
+}
+
+// Helper Method: order pointers for bsearch
+int compare_pointers(const void *a, const void *b)
+{
+    uintptr_t left = (uintptr_t)*(char *const *)a;
+    uintptr_t right = (uintptr_t)*(char *const *)b;
+    return left < right ? -1 : left > right;
+}
+
+// Helper Method: run an oversized command in the fewest batches that fit ARG_MAX, jobs > 1 runs them in parallel
+// Only words a glob expanded to are spread over the batches in order, every literal word (options, their values,
+// a cp or mv destination) goes into each batch at its place. Returns the highest exit code of any batch
+int run_split(char **args, int arg_count, char **envp, char *path_value, long jobs)
+{
+    // Expanded words are told apart by pointer, they are the glob matches' own strings
+    GlobMatches *globs = options.split_words;
+    char **sorted = globs != NULL && globs->count > 0 ? malloc(sizeof(char *) * globs->count) : NULL;
+    char *splits = calloc(arg_count, 1);
+    if (splits == NULL || (sorted == NULL && globs != NULL && globs->count > 0))
+    {
+        fprintf(stderr, "Error: could not allocate split batches\n");
+        free(sorted);
+        free(splits);
+        return 1;
+    }
+    if (sorted != NULL)
+    {
+        memcpy(sorted, globs->paths, sizeof(char *) * globs->count);
+        qsort(sorted, globs->count, sizeof(char *), compare_pointers);
+    }
+    size_t base = arg_list_size(envp) + sizeof(char *);
+    int split_count = 0;
+    int rc = 0;
+    for (int i = 0; i < arg_count && rc == 0; i++)
+    {
+        size_t len = strlen(args[i]) + 1;
+        if (len > ARGSPLIT_MAX_STRLEN)
+        {
+            fprintf(stderr, "Error: argument %.40s... is longer than %d bytes\n", args[i], ARGSPLIT_MAX_STRLEN);
+            rc = 1;
+        }
+        splits[i] = i > 0 && sorted != NULL && bsearch(&args[i], sorted, globs->count, sizeof(char *), compare_pointers) != NULL;
+        split_count += splits[i];
+        base += splits[i] ? 0 : len + sizeof(char *);
+    }
+    free(sorted);
+    if (rc == 0 && split_count == 0)
+    {
+        fprintf(stderr, "Error: %s argument list too long and no glob expansion to split\n", args[0]);
+        rc = 1;
+    }
+    size_t limit = arg_limit();
+    if (rc == 0 && base >= limit)
+    {
+        fprintf(stderr, "Error: %s literal arguments alone do not fit in one command\n", args[0]);
+        rc = 1;
+    }
+
+    // Greedy filling in order gives the fewest batches
+    char ***batches = NULL;
+    int batch_count = 0;
+    int batch_cap = 0;
+    int next = 0;
+    int scan = 0;
+    while (rc == 0 && next < split_count)
+    {
+        // Expanded words next .. next + count - 1 go into this batch
+        size_t size = base;
+        int count = 0;
+        for (int i = scan; i < arg_count && next + count < split_count; i++)
+        {
+            if (!splits[i])
+            {
+                continue;
+            }
+            size_t add = strlen(args[i]) + 1 + sizeof(char *);
+            if (size + add > limit)
+            {
+                break;
+            }
+            size += add;
+            count++;
+        }
+        if (count == 0)
+        {
+            fprintf(stderr, "Error: argument does not fit in one command\n");
+            rc = 1;
+            break;
+        }
+        if (batch_count == batch_cap)
+        {
+            batch_cap = batch_cap ? batch_cap * 2 : 8;
+            char ***grown = realloc(batches, sizeof(char **) * batch_cap);
+            if (grown == NULL)
+            {
+                rc = 1;
+                break;
+            }
+            batches = grown;
+        }
+        char **batch = malloc(sizeof(char *) * (arg_count - split_count + count + 1));
+        if (batch == NULL)
+        {
+            rc = 1;
+            break;
+        }
+        int batch_len = 0;
+        int rank = 0;
+        for (int i = 0; i < arg_count; i++)
+        {
+            if (splits[i])
+            {
+                if (rank >= next && rank < next + count)
+                {
+                    batch[batch_len++] = args[i];
+                    scan = i + 1;
+                }
+                rank++;
+            }
+            else
+            {
+                batch[batch_len++] = args[i];
+            }
+        }
+        batch[batch_len] = NULL;
+        batches[batch_count++] = batch;
+        next += count;
+    }
+    free(splits);
+
+    if (rc == 0 && jobs > 1)
+    {
+        long long start_ns = monotonic_ns();
+        run_parallel_jobs(batches, batch_count, jobs, 0, envp, path_value, &rc);
+        options.profile.child_wall_ns += monotonic_ns() - start_ns;
+    }
+    else if (rc == 0)
+    {
+        // Every batch runs even after a failure, as the whole command would have
+        for (int i = 0; i < batch_count; i++)
+        {
+            int batch_rc = run_external(batches[i], envp, path_value);
+            rc = batch_rc > rc ? batch_rc : rc;
+        }
+    }
+    for (int i = 0; i < batch_count; i++)
+    {
+        free(batches[i]);
+    }
+    free(batches);
+    return rc;
+}
+
+int handle_command(char **args, int arg_count, Redirect *redirect, LocalVariableList *local, History *history, int prev_rc, FILE *file)
+{
+    // Every command goes into the trace ring, redirect word included
+    TraceRecord *previous = options.trace.current;
+    TraceRecord *record = trace_begin(&options.trace, args, arg_count);
+
+    // exec's redirects outlive the command, the builtin opens them instead of applying and restoring them here
+    if (args[0] != NULL && strcmp(args[0], "exec") == 0)
+    {
+        int rc = built_in_exec(args, arg_count);
+        trace_end(&options.trace, record, previous, rc);
+        return rc;
+    }
+
+    // Redirects only last for this command
+    SavedFds saved;
+    saved.count = 0;
+    saved.pump = 0;
+    if (apply_redirect(redirect, &saved) != 0)
+    {
+        restore_redirect(&saved);
+        trace_end(&options.trace, record, previous, 1);
+        return 1;
+    }
+
+    // Remove redirect from args if it was present
+    if (redirect->redirect_type)
+    {
+        for (int i = 0; i < redirect->word_count; i++)
+        {
+            crop_redirect(args, &arg_count);
+        }
+    }
+
+    int rc = run_command(args, arg_count, local, history, prev_rc, file);
+    restore_redirect(&saved);
+    trace_end(&options.trace, record, previous, rc);
+    return rc;
+}
+
+// Helper Method: run builtin or external command once redirects are in place
+int run_command(char **args, int arg_count, LocalVariableList *local, History *history, int prev_rc, FILE *file)
+{
+    // Redirect complete now handle command
     if (args[0] == NULL)
     {
-        fprintf(stderr, "Error: No indentifiable command found!\n");
-        return 1;
+        fprintf(stderr, "Error: No indentifiable command found!\n");
+        return 1;
+    }
+
+    // Leading NAME=value words set variables, or only the command's environment if one follows
+    char **line_args = args;
+    int line_count = arg_count;
+    int assign_count = 0;
+    while (assign_count < arg_count && is_assignment(args[assign_count]))
+    {
+        assign_count++;
+    }
+    if (assign_count == arg_count)
+    {
+        for (int i = 0; i < assign_count; i++)
+        {
+            char *equals = strchr(args[i], '=');
+            *equals = '\0';
+            int ok = set_variable(local, args[i], equals + 1, 0);
+            *equals = '=';
+            if (!ok)
+            {
+                fprintf(stderr, "Error: could not set %s\n", args[i]);
+                return 1;
+            }
+        }
+        return 0;
+    }
+    args += assign_count;
+    arg_count -= assign_count;
+
+    if (strcmp(args[0], "exit") == 0)
+    {
+        if (arg_count == 1)
+        {
+            built_in_exit(local, history, prev_rc, file);
+        }
+        else
+        {
+            fprintf(stderr, "Error: Inproper exit arguments\n");
+            return 1;
+        }
+    }
+    if (strcmp(args[0], "cd") == 0)
+    {
+        return built_in_cd(args, arg_count);
+    }
+    if (strcmp(args[0], "cache") == 0)
+    {
+        return built_in_cache(args, arg_count, local, history, prev_rc, file);
+    }
+    if (strcmp(args[0], "exec") == 0)
+    {
+        return built_in_exec(args, arg_count);
+    }
+    if (strcmp(args[0], "export") == 0)
+    {
+        return built_in_export(args, arg_count, local);
+    }
+    if (strcmp(args[0], "local") == 0)
+    {
+        return built_in_local(args, arg_count, local);
+    }
+    if (strcmp(args[0], "vars") == 0)
+    {
+        return built_in_vars(arg_count, local);
+    }
+    if (strcmp(args[0], "history") == 0)
+    {
+        return built_in_history(args, arg_count, local, history, prev_rc, file);
+    }
+    if (strcmp(args[0], "ls") == 0)
+    {
+        return built_in_ls(arg_count);
+    }
+    if (strcmp(args[0], "parallel") == 0)
+    {
+        return built_in_parallel(args, arg_count, local);
+    }
+    if (strcmp(args[0], "source") == 0 || strcmp(args[0], ".") == 0)
+    {
+        return built_in_source(args, arg_count, local, history, prev_rc);
+    }
+    if (strcmp(args[0], "run") == 0)
+    {
+        return built_in_run(args, arg_count, local, history, prev_rc, file);
+    }
+    if (strcmp(args[0], "set") == 0)
+    {
+        return built_in_set(args, arg_count);
+    }
+    if (strcmp(args[0], "split") == 0)
+    {
+        return built_in_split(args, arg_count, local, history, prev_rc, file);
+    }
+    if (strcmp(args[0], "timeout") == 0)
+    {
+        return built_in_timeout(args, arg_count, local, history, prev_rc, file);
+    }
+    if (strcmp(args[0], "trace") == 0)
+    {
+        return built_in_trace(args, arg_count);
+    }
+    if (strcmp(args[0], "ulimit") == 0)
+    {
+        return built_in_ulimit(args, arg_count);
+    }
+    if (strcmp(args[0], "watch") == 0)
+    {
+        return built_in_watch(args, arg_count, local, history, prev_rc, file);
+    }
+    // Not built in function! Do following:
+
+    // https://git.doit.wisc.edu/cdis/cs/courses/cs537/fall24/public/discussion_material/-/blob/main/week3/fork_exec.c?ref_type=heads
+
+    HistoryItem *newItem = create_history_item(line_args, line_count);
+    if (newItem == NULL)
+    {
+        // Error recorded and frees made already
+        return 1;
+    }
+
+    add_history_item(history, newItem);
+
+    // Overrides apply to this command's environment only
+    char **envp = local->envp;
+    if (assign_count > 0)
+    {
+        envp = build_override_envp(local, line_args, assign_count);
+        if (envp == NULL)
+        {
+            fprintf(stderr, "Error: could not build command environment\n");
+            return 1;
+        }
+    }
+    char *path_value = get_variable(local, "PATH");
+    for (int i = 0; i < assign_count; i++)
+    {
+        if (strncmp(line_args[i], "PATH=", 5) == 0)
+        {
+            path_value = line_args[i] + 5;
+        }
+    }
+
+    // Oversized argument lists fail in execve, split or set -o argsplit runs them in batches
+    int rc;
+    if (arg_list_size(args) + arg_list_size(envp) > arg_limit())
+    {
+        if (options.split_jobs == 0 && !options.argsplit)
+        {
+            fprintf(stderr, "Error: %s argument list too long (use split or set -o argsplit)\n", args[0]);
+            rc = 1;
+        }
+        else
+        {
+            rc = run_split(args, arg_count, envp, path_value, options.split_jobs);
+        }
+    }
+    else
+    {
+        rc = run_external(args, envp, path_value);
+    }
+    if (envp != local->envp)
+    {
+        free(envp);
+    }
+    return rc;
+}
+
+// Helper Method: grow an argument array to hold at least needed entries
+int grow_args(char ***args, int *cap, int needed)
+{
+    int new_cap = *cap;
+    while (new_cap < needed)
+    {
+        new_cap *= 2;
+    }
+    char **grown = realloc(*args, sizeof(char *) * new_cap);
+    if (grown == NULL)
+    {
+        return 0;
+    }
+    *args = grown;
+    *cap = new_cap;
+    return 1;
+}
+
+// Helper Method: append len bytes to a growing buffer
+int here_append(char **buf, size_t *len, size_t *cap, const char *data, size_t data_len)
+{
+    if (*len + data_len > *cap)
+    {
+        size_t new_cap = *cap ? *cap : 4096;
+        while (new_cap < *len + data_len)
+        {
+            new_cap *= 2;
+        }
+        char *grown = realloc(*buf, new_cap);
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        *buf = grown;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, data_len);
+    *len += data_len;
+    return 1;
+}
+
+// Helper Method: append text with $NAME and ${NAME} replaced by their values (unset ones by nothing)
+int here_expand(char **buf, size_t *len, size_t *cap, const char *text, size_t text_len, LocalVariableList *local)
+{
+    const char *end = text + text_len;
+    while (text < end)
+    {
+        const char *dollar = memchr(text, '$', end - text);
+        if (dollar == NULL)
+        {
+            return here_append(buf, len, cap, text, end - text);
+        }
+        if (!here_append(buf, len, cap, text, dollar - text))
+        {
+            return 0;
+        }
+        const char *name = dollar + 1;
+        int braced = name < end && *name == '{';
+        name += braced;
+        const char *name_end = name;
+        while (name_end < end && (*name_end == '_' || (*name_end >= 'a' && *name_end <= 'z') ||
+                                  (*name_end >= 'A' && *name_end <= 'Z') || (name_end > name && *name_end >= '0' && *name_end <= '9')))
+        {
+            name_end++;
+        }
+        // A lone $ (or an unclosed ${) is kept as written
+        if (name_end == name || (braced && (name_end == end || *name_end != '}')))
+        {
+            if (!here_append(buf, len, cap, "$", 1))
+            {
+                return 0;
+            }
+            text = dollar + 1;
+            continue;
+        }
+        char var[MAXLINE];
+        size_t var_len = name_end - name < MAXLINE ? name_end - name : MAXLINE - 1;
+        memcpy(var, name, var_len);
+        var[var_len] = '\0';
+        char *val = replace_var(var, local);
+        if (!here_append(buf, len, cap, val, strlen(val)))
+        {
+            return 0;
+        }
+        text = name_end + braced;
+    }
+    return 1;
+}
+
+// Helper Method: read a here-document body (<<WORD, <<-WORD) or take a here-string (<<<word) into a memfd
+// Body lines come from the script (or stdin when interactive), the descriptor is positioned at the start
+int read_here_body(Redirect *redirect, LocalVariableList *local, FILE *file)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int ok = 1;
+    char *op = strstr(redirect->last_arg, "<<");
+    if (redirect->redirect_type == HS)
+    {
+        char *word = op + 3;
+        ok = here_expand(&buf, &len, &cap, word, strlen(word), local) && here_append(&buf, &len, &cap, "\n", 1);
+    }
+    else
+    {
+        // <<- strips leading tabs from the body and the delimiter line, a quoted delimiter turns off expansion
+        int strip_tabs = op[2] == '-';
+        char *delimiter = op + 2 + strip_tabs;
+        size_t delimiter_len = strlen(delimiter);
+        int expand = 1;
+        if (delimiter_len >= 2 && (delimiter[0] == '\'' || delimiter[0] == '"') && delimiter[delimiter_len - 1] == delimiter[0])
+        {
+            delimiter++;
+            delimiter_len -= 2;
+            expand = 0;
+        }
+        FILE *source = file != NULL ? file : stdin;
+        int prompt = file == NULL && isatty(STDIN_FILENO);
+        char *line = NULL;
+        size_t line_cap = 0;
+        ssize_t line_len;
+        int found = 0;
+        while (ok)
+        {
+            if (prompt)
+            {
+                fputs("> ", stderr);
+            }
+            if ((line_len = getline(&line, &line_cap, source)) < 0)
+            {
+                break;
+            }
+            // Body lines count as script lines, a sourced file's ones stay under the line that sourced it
+            if (options.sources.depth == 0)
+            {
+                options.line_number++;
+            }
+            char *text = line;
+            if (strip_tabs)
+            {
+                while (*text == '\t')
+                {
+                    text++;
+                    line_len--;
+                }
+            }
+            size_t content_len = line_len > 0 && text[line_len - 1] == '\n' ? line_len - 1 : line_len;
+            if (content_len == delimiter_len && strncmp(text, delimiter, delimiter_len) == 0)
+            {
+                found = 1;
+                break;
+            }
+            ok = expand ? here_expand(&buf, &len, &cap, text, line_len, local) : here_append(&buf, &len, &cap, text, line_len);
+        }
+        free(line);
+        if (ok && !found)
+        {
+            fprintf(stderr, "Warning: here-document ended by end of file, wanted %.*s\n", (int)delimiter_len, delimiter);
+        }
+    }
+
+    // Written once, the command reads it as an ordinary file
+    // Kept above the descriptors a redirect names, 3<<EOF would otherwise dup2 the memfd onto itself and stay close-on-exec
+    int fd = ok ? move_fd_high(memfd_create("barber-heredoc", MFD_CLOEXEC)) : -1;
+    if (fd >= 0 && (write_all(fd, buf, len) == -1 || lseek(fd, 0, SEEK_SET) == -1))
+    {
+        close(fd);
+        fd = -1;
+    }
+    free(buf);
+    return fd;
+}
+
+// Helper Method: read the rest of a <(...) or >(...) word, joining the following tokens up to the matching parenthesis
+// Returns the inner command (malloc'd) or NULL if the parentheses do not close at the end of a word
+char *gather_substitution(char *token)
+{
+    size_t len = 0;
+    size_t cap = strlen(token) + 64;
+    char *command = malloc(cap);
+    if (command == NULL)
+    {
+        return NULL;
+    }
+    int depth = 1;
+    while (token != NULL)
+    {
+        size_t token_len = strlen(token);
+        if (len + token_len + 2 > cap)
+        {
+            cap = (len + token_len + 2) * 2;
+            char *grown = realloc(command, cap);
+            if (grown == NULL)
+            {
+                free(command);
+                return NULL;
+            }
+            command = grown;
+        }
+        if (len > 0)
+        {
+            command[len++] = ' ';
+        }
+        for (size_t i = 0; i < token_len; i++)
+        {
+            depth += token[i] == '(' ? 1 : token[i] == ')' ? -1 : 0;
+            if (depth == 0)
+            {
+                // The closing parenthesis must end the word
+                if (i + 1 != token_len)
+                {
+                    break;
+                }
+                memcpy(command + len, token, i);
+                command[len + i] = '\0';
+                return command;
+            }
+        }
+        if (depth == 0)
+        {
+            break;
+        }
+        memcpy(command + len, token, token_len);
+        len += token_len;
+        token = strtok(NULL, " ");
+    }
+    free(command);
+    return NULL;
+}
+
+// Helper Method: start command in a copy of the shell wired to a new pipe, writes picks >(cmd) over <(cmd)
+// Returns the shell's end of the pipe (left open across exec for the main command) or -1
+int start_substitution(Substitutions *subs, char *command, int writes, LocalVariableList *local, History *history, int prev_rc)
+{
+    int pipe_fds[2];
+    if (subs->count == MAXSUBSTITUTIONS || pipe2(pipe_fds, O_CLOEXEC) == -1)
+    {
+        return -1;
+    }
+    // <(cmd) writes into the pipe and the command reads /dev/fd/N, >(cmd) the other way round
+    int child_end = writes ? pipe_fds[0] : pipe_fds[1];
+    int shell_end = writes ? pipe_fds[1] : pipe_fds[0];
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Other substitutions' ends would keep their readers from seeing end of file
+        for (int i = 0; i < subs->count; i++)
+        {
+            close(subs->fds[i]);
+        }
+        close(shell_end);
+        dup2(child_end, writes ? STDIN_FILENO : STDOUT_FILENO);
+        close(child_end);
+        // Script wide outputs belong to the parent shell
+        options.capture_dir = NULL;
+        options.profile.path = NULL;
+        options.journal.fd = -1;
+        int rc = handle_argument(command, local, history, prev_rc, NULL);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(rc);
+    }
+    close(child_end);
+    if (pid < 0)
+    {
+        close(shell_end);
+        return -1;
+    }
+    // The main command inherits this end, it is closed here once the command is done
+    fcntl(shell_end, F_SETFD, 0);
+    subs->pids[subs->count] = pid;
+    subs->fds[subs->count] = shell_end;
+    subs->count++;
+    return shell_end;
+}
+
+// Helper Method: close the shell's pipe ends, then reap every substitution (readers see end of file, writers SIGPIPE)
+void finish_substitutions(Substitutions *subs)
+{
+    for (int i = 0; i < subs->count; i++)
+    {
+        close(subs->fds[i]);
+    }
+    for (int i = 0; i < subs->count; i++)
+    {
+        int status;
+        wait_reap(subs->pids[i], &status);
+    }
+    subs->count = 0;
+}
+
+int handle_argument(char *input, LocalVariableList *local, History *history, int prev_rc, FILE *file)
+{
+    char *token;
+    // Get args via tokens
+    token = strtok(input, " ");
+    // Handle empty line
+    if (token == NULL)
+    {
+        return prev_rc;
+    }
+    // Handle comment:
+    if (token[0] != '#')
+    {
+        // Arguments grow with the expansions, only ARG_MAX bounds what a command can take
+        int arg_cap = MAXARGS;
+        char **args = malloc(sizeof(char *) * arg_cap);
+        if (args == NULL)
+        {
+            fprintf(stderr, "Error: could not malloc args\n");
+            return 1;
+        }
+
+        // Directory listings are shared by every pattern on this line
+        DirCache dir_cache = {0};
+        GlobMatches expanded = {0};
+        Substitutions subs;
+        subs.count = 0;
+
+        // Loop other tokens
+        int arg_count = 0;
+        while (token != NULL)
+        {
+            if (arg_count + 1 >= arg_cap && !grow_args(&args, &arg_cap, arg_count + 2))
+            {
+                fprintf(stderr, "Error: could not grow args\n");
+                free(args);
+                free_glob_matches(&expanded);
+                free_dir_cache(&dir_cache);
+                return 1;
+            }
+            // Process substitution, the word becomes a /dev/fd path to a pipe from (or to) the command
+            if ((token[0] == '<' || token[0] == '>') && token[1] == '(')
+            {
+                char *command = gather_substitution(token + 2);
+                if (command == NULL)
+                {
+                    fprintf(stderr, "Error: unterminated process substitution %s\n", token);
+                    free(args);
+                    free_glob_matches(&expanded);
+                    free_dir_cache(&dir_cache);
+                    finish_substitutions(&subs);
+                    return 1;
+                }
+                int fd = start_substitution(&subs, command, token[0] == '>', local, history, prev_rc);
+                free(command);
+                if (fd < 0)
+                {
+                    fprintf(stderr, "Error: could not start process substitution\n");
+                    free(args);
+                    free_glob_matches(&expanded);
+                    free_dir_cache(&dir_cache);
+                    finish_substitutions(&subs);
+                    return 1;
+                }
+                // Kept apart from the glob matches, a pipe cannot be split over batches
+                snprintf(subs.paths[subs.count - 1], sizeof(subs.paths[0]), "/dev/fd/%d", fd);
+                args[arg_count] = subs.paths[subs.count - 1];
+            }
+            // Replace $<var> with local var
+            else if (token[0] == '$')
+            {
+                // Crop out '$'
+                args[arg_count] = replace_var(token + 1, local);
+                if (args[arg_count] == NULL)
+                {
+                    fprintf(stderr, "Error: count not allocate empty\n");
+                    prev_rc = 1;
+                    break;
+                }
+            }
+            // Expand glob patterns (redirect tokens are left alone)
+            else if (has_glob_chars(token) && strpbrk(token, "<>") == NULL)
+            {
+                int start = expanded.count;
+                int found = expand_glob(token, &dir_cache, &expanded);
+                if (found < 0)
+                {
+                    fprintf(stderr, "Error: could not expand %s\n", token);
+                    free(args);
+                    free_glob_matches(&expanded);
+                    free_dir_cache(&dir_cache);
+                    finish_substitutions(&subs);
+                    return 1;
+                }
+                if (found == 0)
+                {
+                    // No match, pass pattern through unchanged
+                    args[arg_count] = token;
+                }
+                else
+                {
+                    if (arg_count + found + 1 >= arg_cap && !grow_args(&args, &arg_cap, arg_count + found + 2))
+                    {
+                        fprintf(stderr, "Error: could not grow args for %s\n", token);
+                        free(args);
+                        free_glob_matches(&expanded);
+                        free_dir_cache(&dir_cache);
+                        finish_substitutions(&subs);
+                        return 1;
+                    }
+                    for (int i = 0; i < found; i++)
+                    {
+                        args[arg_count++] = expanded.paths[start + i];
+                    }
+                    arg_count--;
+                }
+            }
+            else
+            {
+                // Save token into args
+                args[arg_count] = token;
+            }
+
+            // Get next token
+            arg_count++;
+            token = strtok(NULL, " ");
+        }
+        free_dir_cache(&dir_cache);
+
+        // Terminate args (just in case)
+        args[arg_count] = NULL;
+
+        // Scrape redirect
+        struct Redirect *redirect = malloc(sizeof(Redirect));
+        if (redirect == NULL)
+        {
+            fprintf(stderr, "Error: could not malloc redirect\n");
+            free(args);
+            free_glob_matches(&expanded);
+            finish_substitutions(&subs);
+            return 1;
+        }
+        redirect->last_arg = args[arg_count - 1];
+        redirect->redirect_type = redirect_word_type(redirect->last_arg);
+        redirect->body_fd = -1;
+        redirect->words = args + arg_count - 1;
+        redirect->word_count = 1;
+        // Output redirects of the same descriptor in front of it fan the output out to all of them
+        if (redirect->redirect_type == RO || redirect->redirect_type == ARO)
+        {
+            int target_fd = redirect_word_fd(redirect->last_arg);
+            while (redirect->word_count < arg_count - 1 && redirect->word_count < MAXREDIRECTS)
+            {
+                char *word = args[arg_count - 1 - redirect->word_count];
+                int type = redirect_word_type(word);
+                if ((type != RO && type != ARO) || redirect_word_fd(word) != target_fd)
+                {
+                    break;
+                }
+                redirect->word_count++;
+            }
+            redirect->words = args + arg_count - redirect->word_count;
+        }
+        // Here-document bodies follow the line, they are read before anything runs
+        if (redirect->redirect_type == HD || redirect->redirect_type == HS)
+        {
+            redirect->body_fd = read_here_body(redirect, local, file);
+            if (redirect->body_fd < 0)
+            {
+                fprintf(stderr, "Error: could not read here-document\n");
+                free(redirect);
+                free(args);
+                free_glob_matches(&expanded);
+                finish_substitutions(&subs);
+                return 1;
+            }
+        }
+        GlobMatches *split_words = options.split_words;
+        options.split_words = &expanded;
+        int rc = handle_command(args, arg_count, redirect, local, history, prev_rc, file);
+        options.split_words = split_words;
+        finish_substitutions(&subs);
+        if (redirect->body_fd >= 0)
+        {
+            close(redirect->body_fd);
+        }
+        free(redirect);
+        free(args);
+        free_glob_matches(&expanded);
+        return rc;
+    }
+    return prev_rc;
+}
+
+// Built in names offered by command completion
+static const char *builtin_names[] = {"cache", "cd", "exec", "exit", "export", "history", "local", "ls", "parallel", "run", "set", "source", "split", "timeout", "trace", "ulimit", "vars", "watch", NULL};
+
+// Helper Method: check if a command name is run by the shell itself
+int is_builtin(const char *name)
+{
+    for (int i = 0; builtin_names[i] != NULL; i++)
+    {
+        if (strcmp(builtin_names[i], name) == 0)
+        {
+            return 1;
+        }
+    }
+    return strcmp(name, ".") == 0;
+}
+
+// Helper Method: find child of trie node with character
+TrieNode *trie_child(TrieNode *node, char ch)
+{
+    TrieNode *curr = node->child;
+    while (curr != NULL && curr->ch < ch)
+    {
+        curr = curr->sibling;
+    }
+    return (curr != NULL && curr->ch == ch) ? curr : NULL;
+}
+
+// Helper Method: get trie node for a word, creating nodes if asked
+TrieNode *trie_walk(TrieNode *root, const char *word, int create)
+{
+    TrieNode *node = root;
+    for (; *word; word++)
+    {
+        // Children are kept sorted so completions come out in order
+        TrieNode **link = &node->child;
+        while (*link != NULL && (*link)->ch < *word)
+        {
+            link = &(*link)->sibling;
+        }
+        if (*link == NULL || (*link)->ch != *word)
+        {
+            if (!create)
+            {
+                return NULL;
+            }
+            TrieNode *newNode = calloc(1, sizeof(TrieNode));
+            if (newNode == NULL)
+            {
+                return NULL;
+            }
+            newNode->ch = *word;
+            newNode->sibling = *link;
+            *link = newNode;
+        }
+        node = *link;
+    }
+    return node;
+}
+
+// Helper Method: free trie nodes
+void free_trie_nodes(TrieNode *node)
+{
+    while (node != NULL)
+    {
+        TrieNode *next = node->sibling;
+        free_trie_nodes(node->child);
+        free(node);
+        node = next;
+    }
+}
+
+// Helper Method: collect up to MAXCOMPLETIONS words below node
+void trie_collect(TrieNode *node, char *word, int depth, GlobMatches *out)
+{
+    if (node->terminal && depth > 0)
+    {
+        word[depth] = '\0';
+        add_glob_match(out, word);
+    }
+    for (TrieNode *curr = node->child; curr != NULL && out->count < MAXCOMPLETIONS && depth < MAXLINE - 1; curr = curr->sibling)
+    {
+        word[depth] = curr->ch;
+        trie_collect(curr, word, depth + 1, out);
+    }
+}
+
+// Helper Method: count PATH directories providing an executable name
+int count_executable(CommandTrie *trie, const char *name)
+{
+    int count = 0;
+    for (int i = 0; i < trie->watch_count; i++)
+    {
+        char *path = join_glob_path(trie->watch_dirs[i], name);
+        if (path == NULL)
+        {
+            continue;
+        }
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+        {
+            count++;
+        }
+        free(path);
+    }
+    return count;
+}
+
+// Helper Method: free command trie and its watches
+void free_command_trie(CommandTrie *trie)
+{
+    free_trie_nodes(trie->root);
+    if (trie->inotify_fd >= 0)
+    {
+        close(trie->inotify_fd);
+    }
+    for (int i = 0; i < trie->watch_count; i++)
+    {
+        free(trie->watch_dirs[i]);
+    }
+    free(trie->watch_dirs);
+    free(trie->watch_ds);
+    free(trie->path);
+    memset(trie, 0, sizeof(CommandTrie));
+    trie->inotify_fd = -1;
+}
+
+// Helper Method: build trie from every executable on PATH and watch the directories
+int build_command_trie(CommandTrie *trie, const char *path_value)
+{
+    free_command_trie(trie);
+    trie->root = calloc(1, sizeof(TrieNode));
+    trie->path = strdup(path_value);
+    if (trie->root == NULL || trie->path == NULL)
+    {
+        return 0;
+    }
+    trie->inotify_fd = move_fd_high(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+
+    char *path_copy = strdup(path_value);
+    if (path_copy == NULL)
+    {
+        return 0;
+    }
+    int dir_count = 1;
+    for (char *c = path_copy; *c; c++)
+    {
+        dir_count += *c == ':';
+    }
+    trie->watch_dirs = calloc(dir_count, sizeof(char *));
+    trie->watch_ds = calloc(dir_count, sizeof(int));
+    if (trie->watch_dirs == NULL || trie->watch_ds == NULL)
+    {
+        free(path_copy);
+        return 0;
+    }
+
+    char *saveptr = NULL;
+    for (char *dir = strtok_r(path_copy, ":", &saveptr); dir != NULL; dir = strtok_r(NULL, ":", &saveptr))
+    {
+        int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DirListing *listing = read_dir_listing(dir);
+        if (dir_fd < 0 || listing == NULL)
+        {
+            if (dir_fd >= 0)
+            {
+                close(dir_fd);
+            }
+            free_dir_listing(listing);
+            continue;
+        }
+        for (int i = 0; i < listing->count; i++)
+        {
+            struct stat st;
+            if (fstatat(dir_fd, listing->names[i], &st, 0) == 0 && S_ISREG(st.st_mode) &&
+                faccessat(dir_fd, listing->names[i], X_OK, 0) == 0)
+            {
+                TrieNode *node = trie_walk(trie->root, listing->names[i], 1);
+                if (node != NULL)
+                {
+                    node->terminal++;
+                }
+            }
+        }
+        close(dir_fd);
+        free_dir_listing(listing);
+
+        // Watch for executables appearing, disappearing or changing mode
+        trie->watch_ds[trie->watch_count] = -1;
+        if (trie->inotify_fd >= 0)
+        {
+            trie->watch_ds[trie->watch_count] = inotify_add_watch(trie->inotify_fd, dir,
+                IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE);
+        }
+        trie->watch_dirs[trie->watch_count] = strdup(dir);
+        if (trie->watch_dirs[trie->watch_count] != NULL)
+        {
+            trie->watch_count++;
+        }
+    }
+    free(path_copy);
+    return 1;
+}
+
+// Helper Method: bring trie up to date (lazy build, PATH change, pending inotify events)
+int refresh_command_trie(CommandTrie *trie, LocalVariableList *local)
+{
+    char *path_value = get_variable(local, "PATH");
+    if (path_value == NULL)
+    {
+        path_value = "";
+    }
+    if (trie->root == NULL || strcmp(trie->path, path_value) != 0)
+    {
+        return build_command_trie(trie, path_value);
+    }
+    if (trie->inotify_fd < 0)
+    {
+        return 1;
+    }
+
+    // Apply only the names that changed since last completion
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(trie->inotify_fd, events, sizeof(events))) > 0)
+    {
+        for (char *ptr = events; ptr < events + len;)
+        {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                return build_command_trie(trie, path_value);
+            }
+            if (event->len == 0)
+            {
+                continue;
+            }
+            int count = count_executable(trie, event->name);
+            TrieNode *node = trie_walk(trie->root, event->name, count > 0);
+            if (node != NULL)
+            {
+                node->terminal = count;
+            }
+        }
+    }
+    return 1;
+}
+
+// Helper Method: longest common prefix length of candidates
+int common_prefix_length(GlobMatches *candidates)
+{
+    if (candidates->count == 0)
+    {
+        return 0;
+    }
+    int len = strlen(candidates->paths[0]);
+    for (int i = 1; i < candidates->count; i++)
+    {
+        int j = 0;
+        while (j < len && candidates->paths[i][j] == candidates->paths[0][j])
+        {
+            j++;
+        }
+        len = j;
+    }
+    return len;
+}
+
+// Helper Method: collect command candidates for prefix
+void complete_command(CommandTrie *trie, const char *prefix, LocalVariableList *local, GlobMatches *out)
+{
+    for (int i = 0; builtin_names[i] != NULL; i++)
+    {
+        if (strncmp(builtin_names[i], prefix, strlen(prefix)) == 0)
+        {
+            add_glob_match(out, builtin_names[i]);
+        }
+    }
+    if (!refresh_command_trie(trie, local))
+    {
+        return;
+    }
+    TrieNode *node = trie_walk(trie->root, prefix, 0);
+    if (node == NULL)
+    {
+        return;
+    }
+    char word[MAXLINE];
+    int depth = strlen(prefix);
+    if (depth >= MAXLINE)
+    {
+        return;
+    }
+    memcpy(word, prefix, depth);
+    if (node->terminal)
+    {
+        word[depth] = '\0';
+        add_glob_match(out, word);
+    }
+    for (TrieNode *curr = node->child; curr != NULL && out->count < MAXCOMPLETIONS; curr = curr->sibling)
+    {
+        word[depth] = curr->ch;
+        trie_collect(curr, word, depth + 1, out);
+    }
+    // Builtins and PATH may both provide a name
+    qsort(out->paths, out->count, sizeof(char *), compare_strings);
+    int unique = 0;
+    for (int i = 0; i < out->count; i++)
+    {
+        if (unique > 0 && strcmp(out->paths[unique - 1], out->paths[i]) == 0)
+        {
+            free(out->paths[i]);
+            continue;
+        }
+        out->paths[unique++] = out->paths[i];
+    }
+    out->count = unique;
+}
+
+// Helper Method: collect file candidates for word, directories end in '/'
+void complete_file(const char *word, GlobMatches *out)
+{
+    const char *slash = strrchr(word, '/');
+    const char *base = slash ? slash + 1 : word;
+    char dir[MAXLINE];
+    if (slash == NULL)
+    {
+        strcpy(dir, ".");
+    }
+    else if (slash == word)
+    {
+        strcpy(dir, "/");
+    }
+    else
+    {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - word), word);
+    }
+
+    DirListing *listing = read_dir_listing(dir);
+    if (listing == NULL)
+    {
+        return;
+    }
+
+    // Names are sorted, binary search to the first one with the prefix
+    size_t base_len = strlen(base);
+    int lo = 0;
+    int hi = listing->count;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (strncmp(listing->names[mid], base, base_len) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    for (int i = lo; i < listing->count && out->count < MAXCOMPLETIONS; i++)
+    {
+        if (strncmp(listing->names[i], base, base_len) != 0)
+        {
+            break;
+        }
+        if (listing->names[i][0] == '.' && base[0] != '.')
+        {
+            continue;
+        }
+        char candidate[MAXLINE];
+        int dir_len = slash ? (int)(slash - word) + 1 : 0;
+        char *full = join_glob_path(dir, listing->names[i]);
+        int is_dir = full != NULL && glob_entry_is_dir(full, listing->types[i]);
+        free(full);
+        snprintf(candidate, sizeof(candidate), "%.*s%s%s", dir_len, word, listing->names[i], is_dir ? "/" : "");
+        add_glob_match(out, candidate);
+    }
+    free_dir_listing(listing);
+}
+
+// Helper Method: collect $variable candidates (local and exported share one store)
+void complete_variable(const char *word, LocalVariableList *local, GlobMatches *out)
+{
+    const char *prefix = word + 1;
+    size_t prefix_len = strlen(prefix);
+    char candidate[MAXLINE];
+    for (LocalVariable *curr = local->head; curr != NULL; curr = curr->next)
+    {
+        if (strncmp(curr->var, prefix, prefix_len) == 0)
+        {
+            snprintf(candidate, sizeof(candidate), "$%s", curr->var);
+            add_glob_match(out, candidate);
+        }
+    }
+    qsort(out->paths, out->count, sizeof(char *), compare_strings);
+}
+
+// Helper Method: forget what is on screen so the next redraw repaints everything
+void editor_invalidate(LineEditor *ed)
+{
+    ed->shown_len = 0;
+    ed->shown_cursor = 0;
+}
+
+// Helper Method: redraw only cells that changed since last redraw, in a single write
+void editor_refresh(LineEditor *ed)
+{
+    char render[sizeof(ed->shown)];
+    int render_len;
+    int cursor;
+
+    if (ed->searching)
+    {
+        // Reverse search shows the query and the current match
+        HistoryItem *item = ed->search_count > 0 ? ed->search_results[ed->search_pos] : NULL;
+        render_len = snprintf(render, sizeof(render), "(%sreverse-i-search)`%.*s': ",
+                              item == NULL && ed->query_len > 0 ? "failed " : "", ed->query_len, ed->query);
+        cursor = render_len;
+        render_len += snprintf(render + render_len, sizeof(render) - render_len, "%s", item ? item->line : "");
+    }
+    else
+    {
+        // Scroll horizontally so the line never wraps
+        struct winsize ws;
+        int cols = 80;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        {
+            cols = ws.ws_col;
+        }
+        int prompt_len = strlen(ed->prompt);
+        int room = cols - prompt_len - 1;
+        int offset = 0;
+        if (room < 1)
+        {
+            room = 1;
+        }
+        if (ed->pos > room)
+        {
+            offset = ed->pos - room;
+        }
+        int visible = ed->len - offset < room ? ed->len - offset : room;
+        render_len = snprintf(render, sizeof(render), "%s%.*s", ed->prompt, visible, ed->buf + offset);
+        cursor = prompt_len + ed->pos - offset;
+    }
+    if (render_len >= (int)sizeof(render))
+    {
+        render_len = sizeof(render) - 1;
+    }
+    if (cursor > render_len)
+    {
+        cursor = render_len;
+    }
+
+    // Skip the common prefix with what is already on screen
+    int diff = 0;
+    while (diff < render_len && diff < ed->shown_len && render[diff] == ed->shown[diff])
+    {
+        diff++;
+    }
+
+    char out[sizeof(render) + 64];
+    int n = 0;
+    int col = ed->shown_cursor;
+    if (diff < render_len || diff < ed->shown_len)
+    {
+        if (diff < col)
+        {
+            n += snprintf(out + n, sizeof(out) - n, "\x1b[%dD", col - diff);
+        }
+        else if (diff > col)
+        {
+            n += snprintf(out + n, sizeof(out) - n, "\x1b[%dC", diff - col);
+        }
+        memcpy(out + n, render + diff, render_len - diff);
+        n += render_len - diff;
+        col = render_len;
+        if (render_len < ed->shown_len)
+        {
+            n += snprintf(out + n, sizeof(out) - n, "\x1b[K");
+        }
+    }
+    if (cursor < col)
+    {
+        n += snprintf(out + n, sizeof(out) - n, "\x1b[%dD", col - cursor);
+    }
+    else if (cursor > col)
+    {
+        n += snprintf(out + n, sizeof(out) - n, "\x1b[%dC", cursor - col);
+    }
+
+    if (n > 0 && write(STDOUT_FILENO, out, n) < 0)
+    {
+        editor_invalidate(ed);
+        return;
+    }
+    memcpy(ed->shown, render, render_len);
+    ed->shown_len = render_len;
+    ed->shown_cursor = cursor;
+}
+
+// Helper Method: insert text at cursor
+void editor_insert(LineEditor *ed, const char *text, int text_len)
+{
+    if (ed->len + text_len >= ed->size)
+    {
+        text_len = ed->size - 1 - ed->len;
+    }
+    if (text_len <= 0)
+    {
+        return;
+    }
+    memmove(ed->buf + ed->pos + text_len, ed->buf + ed->pos, ed->len - ed->pos);
+    memcpy(ed->buf + ed->pos, text, text_len);
+    ed->len += text_len;
+    ed->pos += text_len;
+}
+
+// Helper Method: delete range [from, to) and optionally save it for yanking
+void editor_delete(LineEditor *ed, int from, int to, int save)
+{
+    if (from < 0)
+    {
+        from = 0;
+    }
+    if (to > ed->len)
+    {
+        to = ed->len;
+    }
+    if (from >= to)
+    {
+        return;
+    }
+    if (save)
+    {
+        memcpy(ed->kill, ed->buf + from, to - from);
+        ed->kill_len = to - from;
+    }
+    memmove(ed->buf + from, ed->buf + to, ed->len - to);
+    ed->len -= to - from;
+    if (ed->pos > to)
+    {
+        ed->pos -= to - from;
+    }
+    else if (ed->pos > from)
+    {
+        ed->pos = from;
+    }
+}
+
+// Helper Method: find start of word before pos / end of word after pos
+int editor_word_left(LineEditor *ed)
+{
+    int pos = ed->pos;
+    while (pos > 0 && ed->buf[pos - 1] == ' ')
+    {
+        pos--;
+    }
+    while (pos > 0 && ed->buf[pos - 1] != ' ')
+    {
+        pos--;
+    }
+    return pos;
+}
+
+int editor_word_right(LineEditor *ed)
+{
+    int pos = ed->pos;
+    while (pos < ed->len && ed->buf[pos] == ' ')
+    {
+        pos++;
+    }
+    while (pos < ed->len && ed->buf[pos] != ' ')
+    {
+        pos++;
+    }
+    return pos;
+}
+
+// Helper Method: replace line contents
+void editor_set_line(LineEditor *ed, const char *text)
+{
+    ed->len = snprintf(ed->buf, ed->size, "%s", text);
+    if (ed->len >= ed->size)
+    {
+        ed->len = ed->size - 1;
+    }
+    ed->pos = ed->len;
+}
+
+// Helper Method: move through history (direction 1 is older, -1 is newer)
+void editor_history_move(LineEditor *ed, History *history, int direction)
+{
+    HistoryItem *item;
+    if (direction > 0)
+    {
+        item = ed->history_item ? ed->history_item->next : history->head;
+        if (item == NULL)
+        {
+            return;
+        }
+    }
+    else
+    {
+        if (ed->history_item == NULL)
+        {
+            return;
+        }
+        item = ed->history_item->prev;
+    }
+
+    // Remember the line being typed before leaving it
+    if (ed->history_item == NULL)
+    {
+        snprintf(ed->saved, sizeof(ed->saved), "%.*s", ed->len, ed->buf);
+    }
+    ed->history_item = item;
+    editor_set_line(ed, item ? item->line : ed->saved);
+}
+
+// Helper Method: rerun reverse search for the current query
+void editor_search(LineEditor *ed, History *history)
+{
+    ed->search_count = history_search(history, ed->query, ed->search_results, HISTORY_SEARCH_LIMIT);
+    ed->search_pos = 0;
+}
+
+// Helper Method: leave reverse search, keeping the match in the line if accepted
+void editor_end_search(LineEditor *ed, int accept)
+{
+    ed->searching = 0;
+    if (!accept || ed->search_count == 0)
+    {
+        return;
+    }
+    HistoryItem *item = ed->search_results[ed->search_pos];
+    if (ed->history_item == NULL)
+    {
+        snprintf(ed->saved, sizeof(ed->saved), "%.*s", ed->len, ed->buf);
+    }
+    editor_set_line(ed, item->line);
+    ed->history_item = item;
+}
+
+// Helper Method: complete word before cursor
+void editor_complete(LineEditor *ed, LocalVariableList *local)
+{
+    // Find start of current word
+    int start = ed->pos;
+    while (start > 0 && ed->buf[start - 1] != ' ')
+    {
+        start--;
+    }
+    char word[MAXLINE];
+    snprintf(word, sizeof(word), "%.*s", ed->pos - start, ed->buf + start);
+
+    // First word is a command unless it looks like a path
+    int first_word = 1;
+    for (int i = 0; i < start; i++)
+    {
+        if (ed->buf[i] != ' ')
+        {
+            first_word = 0;
+        }
+    }
+
+    GlobMatches candidates = {0};
+    if (word[0] == '$')
+    {
+        complete_variable(word, local, &candidates);
+    }
+    else if (first_word && strchr(word, '/') == NULL)
+    {
+        complete_command(&ed->trie, word, local, &candidates);
+    }
+    else
+    {
+        complete_file(word, &candidates);
+    }
+
+    int word_len = strlen(word);
+    int prefix_len = common_prefix_length(&candidates);
+    if (candidates.count == 1)
+    {
+        // Unique match, finish word (directories stay open for further completion)
+        editor_insert(ed, candidates.paths[0] + word_len, prefix_len - word_len);
+        if (prefix_len == 0 || candidates.paths[0][prefix_len - 1] != '/')
+        {
+            editor_insert(ed, " ", 1);
+        }
+    }
+    else if (prefix_len > word_len)
+    {
+        editor_insert(ed, candidates.paths[0] + word_len, prefix_len - word_len);
+    }
+    else if (candidates.count > 1 && ed->last_was_tab)
+    {
+        // Second tab with nothing to add, list candidates under the prompt
+        if (write(STDOUT_FILENO, "\r\n", 2) < 0)
+        {
+            free_glob_matches(&candidates);
+            return;
+        }
+        for (int i = 0; i < candidates.count; i++)
+        {
+            dprintf(STDOUT_FILENO, "%s%s", candidates.paths[i], i + 1 < candidates.count ? "  " : "\r\n");
+        }
+        editor_invalidate(ed);
+    }
+    free_glob_matches(&candidates);
+}
+
+// Helper Method: get next input byte, waiting at most timeout_ms (-1 blocks), returns 0 on timeout/EOF
+int editor_read_byte(LineEditor *ed, char *c, int timeout_ms)
+{
+    if (ed->pending_pos == ed->pending_len)
+    {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (timeout_ms >= 0 && poll(&pfd, 1, timeout_ms) <= 0)
+        {
+            return 0;
+        }
+        ssize_t got = read(STDIN_FILENO, ed->pending, sizeof(ed->pending));
+        if (got <= 0)
+        {
+            return 0;
+        }
+        ed->pending_len = got;
+        ed->pending_pos = 0;
+    }
+    *c = ed->pending[ed->pending_pos++];
+    return 1;
+}
+
+// Helper Method: decode an escape sequence into the matching control key (0 if unbound)
+int editor_read_escape(LineEditor *ed)
+{
+    char seq;
+    if (!editor_read_byte(ed, &seq, ESCAPE_TIMEOUT_MS))
+    {
+        return 0;
+    }
+    // Alt-b / Alt-f / Alt-d word commands
+    if (seq == 'b' || seq == 'f' || seq == 'd')
+    {
+        return seq == 'b' ? KEY_WORD_LEFT : seq == 'f' ? KEY_WORD_RIGHT : KEY_KILL_WORD;
+    }
+    if (seq != '[' && seq != 'O')
+    {
+        return 0;
+    }
+    // Parameters (as in ESC [1;5C) run up to a final byte in 0x40-0x7E, all of it is consumed so
+    // an unbound key never leaves its tail in the line, ESC O keys have the final byte right away
+    char params[16];
+    size_t param_len = 0;
+    char final;
+    while (1)
+    {
+        if (!editor_read_byte(ed, &final, ESCAPE_TIMEOUT_MS))
+        {
+            return 0;
+        }
+        if (seq == 'O' || (final >= 0x40 && final <= 0x7E))
+        {
+            break;
+        }
+        if (param_len < sizeof(params) - 1)
+        {
+            params[param_len++] = final;
+        }
+    }
+    params[param_len] = '\0';
+    // Alt (modifier 3) or Ctrl (5) with Left/Right moves by word, Shift and the rest act as the plain arrow
+    char *semicolon = strchr(params, ';');
+    int modifier = semicolon != NULL ? atoi(semicolon + 1) : 1;
+    int by_word = modifier == 3 || modifier == 5;
+    if (final == '~')
+    {
+        switch (atoi(params))
+        {
+            case 1:
+            case 7:
+                return 1;
+            case 4:
+            case 8:
+                return 5;
+            case 3:
+                return KEY_DELETE;
+            default:
+                return 0;
+        }
+    }
+    switch (final)
+    {
+        case 'A':
+            return 16;
+        case 'B':
+            return 14;
+        case 'C':
+            return by_word ? KEY_WORD_RIGHT : 6;
+        case 'D':
+            return by_word ? KEY_WORD_LEFT : 2;
+        case 'H':
+            return 1;
+        case 'F':
+            return 5;
+        default:
+            return 0;
+    }
+}
+
+// Helper Method: apply one key to the editor, returns 1 when the line is finished (-1 on EOF)
+int editor_handle_key(LineEditor *ed, char c, History *history, LocalVariableList *local)
+{
+    int was_tab = 0;
+    int key = (unsigned char)c;
+    if (c == 27)
+    {
+        // Escape sequences map onto the equivalent control keys or KEY_* codes
+        key = editor_read_escape(ed);
+        if (key == 0)
+        {
+            return 0;
+        }
+    }
+
+    if (ed->searching)
+    {
+        if (key == 18)
+        {
+            // ctrl-r again: next best match
+            if (ed->search_pos + 1 < ed->search_count)
+            {
+                ed->search_pos++;
+            }
+            return 0;
+        }
+        if (key == 127 || key == 8)
+        {
+            if (ed->query_len > 0)
+            {
+                ed->query[--ed->query_len] = '\0';
+                editor_search(ed, history);
+            }
+            return 0;
+        }
+        if (key == 7)
+        {
+            // ctrl-g: abandon search
+            editor_end_search(ed, 0);
+            return 0;
+        }
+        if (key >= 32 && key < KEY_DELETE && key != 127 && ed->query_len < (int)sizeof(ed->query) - 1)
+        {
+            ed->query[ed->query_len++] = c;
+            ed->query[ed->query_len] = '\0';
+            editor_search(ed, history);
+            return 0;
+        }
+        // Any other key accepts the match and is then handled normally
+        editor_end_search(ed, 1);
+    }
+
+    switch (key)
+    {
+        case '\r':
+        case '\n':
+            return 1;
+        case 1:
+            ed->pos = 0;
+            break;
+        case 5:
+            ed->pos = ed->len;
+            break;
+        case 2:
+            ed->pos -= ed->pos > 0;
+            break;
+        case 6:
+            ed->pos += ed->pos < ed->len;
+            break;
+        case KEY_WORD_LEFT:
+            ed->pos = editor_word_left(ed);
+            break;
+        case KEY_WORD_RIGHT:
+            ed->pos = editor_word_right(ed);
+            break;
+        case KEY_KILL_WORD:
+            editor_delete(ed, ed->pos, editor_word_right(ed), 1);
+            break;
+        case 4:
+            // ctrl-d on empty line is EOF, otherwise delete under cursor
+            if (ed->len == 0)
+            {
+                return -1;
+            }
+            editor_delete(ed, ed->pos, ed->pos + 1, 0);
+            break;
+        case KEY_DELETE:
+            editor_delete(ed, ed->pos, ed->pos + 1, 0);
+            break;
+        case 127:
+        case 8:
+            editor_delete(ed, ed->pos - 1, ed->pos, 0);
+            break;
+        case 11:
+            editor_delete(ed, ed->pos, ed->len, 1);
+            break;
+        case 21:
+            editor_delete(ed, 0, ed->pos, 1);
+            break;
+        case 23:
+            editor_delete(ed, editor_word_left(ed), ed->pos, 1);
+            break;
+        case 25:
+            editor_insert(ed, ed->kill, ed->kill_len);
+            break;
+        case 20:
+            // ctrl-t: swap the two characters before the cursor
+            if (ed->pos > 0 && ed->len > 1)
+            {
+                int at = ed->pos == ed->len ? ed->pos - 1 : ed->pos;
+                char tmp = ed->buf[at - 1];
+                ed->buf[at - 1] = ed->buf[at];
+                ed->buf[at] = tmp;
+                ed->pos = at + 1;
+            }
+            break;
+        case 12:
+            // ctrl-l: clear screen, then repaint everything
+            if (write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7) < 0)
+            {
+                return -1;
+            }
+            editor_invalidate(ed);
+            break;
+        case 16:
+            editor_history_move(ed, history, 1);
+            break;
+        case 14:
+            editor_history_move(ed, history, -1);
+            break;
+        case 18:
+            ed->searching = 1;
+            ed->query_len = 0;
+            ed->query[0] = '\0';
+            ed->search_count = 0;
+            ed->search_pos = 0;
+            break;
+        case '\t':
+            editor_complete(ed, local);
+            was_tab = 1;
+            break;
+        default:
+            if (key >= 32 && key < KEY_DELETE)
+            {
+                editor_insert(ed, &c, 1);
+            }
+            break;
+    }
+    ed->last_was_tab = was_tab;
+    return 0;
+}
+
+// Helper Method: read one line in raw mode, returns length or -1 on EOF
+int read_line(LineEditor *ed, char *buf, int size, History *history, LocalVariableList *local)
+{
+    struct termios orig;
+    if (tcgetattr(STDIN_FILENO, &orig) == -1)
+    {
+        return -1;
+    }
+    struct termios raw = orig;
+    // Keep ISIG so ctrl-c still behaves as before
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+    {
+        return -1;
+    }
+
+    ed->buf = buf;
+    ed->size = size;
+    ed->len = 0;
+    ed->pos = 0;
+    ed->last_was_tab = 0;
+    ed->history_item = NULL;
+    ed->searching = 0;
+    if (write(STDOUT_FILENO, "\r", 1) < 0)
+    {
+        return -1;
+    }
+    editor_invalidate(ed);
+    editor_refresh(ed);
+
+    int rc = 0;
+    while (rc == 0)
+    {
+        char c;
+        if (!editor_read_byte(ed, &c, -1))
+        {
+            rc = -1;
+            break;
+        }
+        long long start = monotonic_ns();
+        rc = editor_handle_key(ed, c, history, local);
+
+        // Apply everything already typed (paste, slow links) before paying for one redraw
+        while (rc == 0 && (ed->pending_pos < ed->pending_len || poll(&(struct pollfd){STDIN_FILENO, POLLIN, 0}, 1, 0) > 0))
+        {
+            if (!editor_read_byte(ed, &c, 0))
+            {
+                break;
+            }
+            rc = editor_handle_key(ed, c, history, local);
+        }
+        if (rc == 0)
+        {
+            editor_refresh(ed);
+        }
+
+        long long elapsed = monotonic_ns() - start;
+        ed->key_batches++;
+        ed->latency_total_ns += elapsed;
+        if (elapsed > ed->latency_max_ns)
+        {
+            ed->latency_max_ns = elapsed;
+        }
+    }
+
+    if (ed->searching)
+    {
+        editor_end_search(ed, 1);
+    }
+    if (rc > 0)
+    {
+        // Show the final line before moving on
+        ed->searching = 0;
+        editor_refresh(ed);
+        rc = ed->len;
+    }
+    buf[ed->len] = '\0';
+    if (write(STDOUT_FILENO, "\r\n", 2) < 0)
+    {
+        rc = -1;
+    }
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig);
+    return rc;
+}
+
+// Helper Method: report editor latency when BARBER_EDITOR_STATS is set
+void editor_report_stats(LineEditor *ed)
+{
+    if (getenv("BARBER_EDITOR_STATS") != NULL && ed->key_batches > 0)
+    {
+        fprintf(stderr, "editor: %lld redraws, avg %lld us, max %lld us\n", ed->key_batches,
+                ed->latency_total_ns / ed->key_batches / 1000, ed->latency_max_ns / 1000);
+    }
+}
+
+void interactive_loop(LocalVariableList *local, History *history)
+{
+    int prev_rc = 0;
+    char input[MAXLINE];
+    FILE *file = NULL;
+    // Editor state lives across lines (completion trie is built on first use)
+    static LineEditor editor;
+    editor.prompt = "barber> ";
+    editor.trie.inotify_fd = -1;
+    while (1)
+    {
+        // Terminal input goes through the line editor
+        if (isatty(STDIN_FILENO))
+        {
+            if (read_line(&editor, input, sizeof(input), history, local) < 0)
+            {
+                editor_report_stats(&editor);
+                free_command_trie(&editor.trie);
+                built_in_exit(local, history, prev_rc, file);
+            }
+            options.line_number++;
+            prev_rc = handle_argument(input, local, history, prev_rc, file);
+            continue;
+        }
+
+        // Prompt user
+        printf("barber> ");
+        // Piazza recommended
+        fflush(stdout);
+        // Get input line
+        if (fgets(input, sizeof(input), stdin) == NULL)
+        {
+            built_in_exit(local, history, prev_rc, file);
+        }
+        // Handle ctrl-d input
+        if (feof(stdin))
+        {
+            built_in_exit(local, history, prev_rc, file);
+        }
+        // Remove newline (incase)
+        input[strcspn(input, "\n")] = '\0';
+        options.line_number++;
+        // Handle and breakdown argument
+        prev_rc = handle_argument(input, local, history, prev_rc, file);
+    }
+}
+
+// Helper Method: FNV-1a hash of a byte range
+uint32_t hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Helper Method: append one kind/name/value entry to a journal payload
+int journal_add_entry(char **buf, size_t *len, size_t *cap, char kind, const char *name, const char *value)
+{
+    size_t name_len = strlen(name) + 1;
+    size_t value_len = strlen(value) + 1;
+    size_t needed = sizeof(JournalRecord) + *len + 1 + name_len + value_len;
+    if (needed > *cap)
+    {
+        size_t new_cap = *cap ? *cap : 256;
+        while (new_cap < needed)
+        {
+            new_cap *= 2;
+        }
+        char *grown = realloc(*buf, new_cap);
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        *buf = grown;
+        *cap = new_cap;
+    }
+    // Header room is kept at the front so the record goes out in one write
+    char *dest = *buf + sizeof(JournalRecord) + *len;
+    *dest++ = kind;
+    memcpy(dest, name, name_len);
+    memcpy(dest + name_len, value, value_len);
+    *len += 1 + name_len + value_len;
+    return 1;
+}
+
+// Helper Method: append the shell settings (set options, ulimits, run defaults, exec descriptors) to a journal payload
+// Descriptors are saved by the path they are open on, pipes and sockets cannot be reopened on resume
+int journal_add_settings(char **buf, size_t *len, size_t *cap)
+{
+    int ok = 1;
+    for (int i = 0; set_options[i].name != NULL && ok; i++)
+    {
+        ok = journal_add_entry(buf, len, cap, 'o', set_options[i].name, *set_options[i].value ? "1" : "0");
+    }
+    char name[32];
+    char value[PATH_MAX + 32];
+    for (int i = 0; i < LIMIT_COUNT && ok; i++)
+    {
+        snprintf(name, sizeof(name), "%c", limit_table[i].flag);
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)options.limits[i]);
+        ok = journal_add_entry(buf, len, cap, 'l', name, value);
+    }
+    // Run defaults field by field, "-" for ones the children inherit from the shell
+    SchedSettings *sched = &options.sched;
+    char cpus[CPU_LIST_MAX] = "-";
+    if (sched->cpu_count > 0)
+    {
+        format_cpu_list(&sched->cpus, cpus, sizeof(cpus));
+    }
+    ok = ok && journal_add_entry(buf, len, cap, 'r', "cpus", cpus);
+    ok = ok && journal_add_entry(buf, len, cap, 'r', "spread", sched->spread ? "1" : "0");
+    snprintf(value, sizeof(value), sched->nice_set ? "%d" : "-", sched->nice);
+    ok = ok && journal_add_entry(buf, len, cap, 'r', "nice", value);
+    snprintf(value, sizeof(value), "-");
+    for (int i = 0; sched_policies[i].name != NULL; i++)
+    {
+        if (sched->policy == sched_policies[i].value)
+        {
+            snprintf(value, sizeof(value), "%s", sched_policies[i].name);
+        }
+    }
+    ok = ok && journal_add_entry(buf, len, cap, 'r', "policy", value);
+    snprintf(value, sizeof(value), sched->io_class > 0 ? "%d:%d" : "-", sched->io_class, sched->io_level);
+    ok = ok && journal_add_entry(buf, len, cap, 'r', "io", value);
+    for (int fd = 0; fd < EXEC_MAXFD && ok; fd++)
+    {
+        if (!(options.exec_fds & (1u << fd)))
+        {
+            continue;
+        }
+        char link[32];
+        char path[PATH_MAX];
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+        int flags = fcntl(fd, F_GETFL);
+        ssize_t path_len = flags == -1 ? -1 : readlink(link, path, sizeof(path) - 1);
+        if (path_len < 0)
+        {
+            snprintf(value, sizeof(value), "-");
+        }
+        else
+        {
+            path[path_len] = '\0';
+            snprintf(value, sizeof(value), "%d:%s", flags & (O_ACCMODE | O_APPEND), path);
+        }
+        snprintf(name, sizeof(name), "%d", fd);
+        ok = journal_add_entry(buf, len, cap, 'f', name, value);
+    }
+    return ok;
+}
+
+// Helper Method: restore one settings entry written by journal_add_settings
+void journal_apply_setting(char kind, const char *name, const char *value)
+{
+    if (kind == 'o')
+    {
+        for (int i = 0; set_options[i].name != NULL; i++)
+        {
+            if (strcmp(name, set_options[i].name) == 0)
+            {
+                *set_options[i].value = value[0] == '1';
+            }
+        }
+    }
+    else if (kind == 'l')
+    {
+        for (int i = 0; i < LIMIT_COUNT; i++)
+        {
+            if (name[0] == limit_table[i].flag)
+            {
+                options.limits[i] = strtoull(value, NULL, 10);
+            }
+        }
+    }
+    else if (kind == 'r')
+    {
+        SchedSettings *sched = &options.sched;
+        int inherited = strcmp(value, "-") == 0;
+        if (strcmp(name, "cpus") == 0)
+        {
+            sched->cpu_count = inherited ? 0 : parse_cpu_list(value, &sched->cpus);
+            sched->cpu_count = sched->cpu_count < 0 ? 0 : sched->cpu_count;
+        }
+        else if (strcmp(name, "spread") == 0)
+        {
+            sched->spread = value[0] == '1';
+        }
+        else if (strcmp(name, "nice") == 0)
+        {
+            sched->nice_set = !inherited;
+            sched->nice = inherited ? 0 : atoi(value);
+        }
+        else if (strcmp(name, "policy") == 0)
+        {
+            sched->policy = -1;
+            for (int i = 0; sched_policies[i].name != NULL; i++)
+            {
+                sched->policy = strcmp(value, sched_policies[i].name) == 0 ? sched_policies[i].value : sched->policy;
+            }
+        }
+        else if (strcmp(name, "io") == 0 && (inherited || sscanf(value, "%d:%d", &sched->io_class, &sched->io_level) != 2))
+        {
+            sched->io_class = 0;
+            sched->io_level = 0;
+        }
+    }
+    else if (kind == 'f')
+    {
+        // Output reopens at the end of what the crashed run wrote, input from the start
+        int fd = atoi(name);
+        char *path = strchr(value, ':');
+        options.exec_fds |= 1u << fd;
+        if (strcmp(value, "-") == 0)
+        {
+            close(fd);
+            return;
+        }
+        int flags = path != NULL ? atoi(value) : -1;
+        int opened = path != NULL && path[1] == '/' ? open(path + 1, flags | (flags & O_ACCMODE ? O_CREAT : 0), 0644) : -1;
+        if (opened == -1)
+        {
+            fprintf(stderr, "Error: could not reopen descriptor %d on %s\n", fd, path != NULL ? path + 1 : value);
+            return;
+        }
+        if ((flags & O_ACCMODE) != O_RDONLY)
+        {
+            lseek(opened, 0, SEEK_END);
+        }
+        if (opened != fd)
+        {
+            dup2(opened, fd);
+            close(opened);
+        }
+    }
+}
+
+// Helper Method: fill in the header in front of a payload and write the whole record
+int journal_write_record(int fd, char **buf, size_t len, uint64_t offset, uint64_t line, int exit_code)
+{
+    if (*buf == NULL)
+    {
+        *buf = malloc(sizeof(JournalRecord));
+        if (*buf == NULL)
+        {
+            return -1;
+        }
+    }
+    JournalRecord header = {JOURNAL_MAGIC, (uint32_t)len, hash_bytes(*buf + sizeof(JournalRecord), len), exit_code, offset, line};
+    memcpy(*buf, &header, sizeof(header));
+    return write_all(fd, *buf, sizeof(header) + len);
+}
+
+// Helper Method: write every variable and the directory to FILE.snap, then start the journal over
+// Resume cost is bounded by one snapshot plus at most JOURNAL_SNAPSHOT_RECORDS records
+int journal_snapshot(Journal *journal, LocalVariableList *local, uint64_t offset, int exit_code)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int ok = 1;
+    for (LocalVariable *curr = local->head; curr != NULL && ok; curr = curr->next)
+    {
+        ok = journal_add_entry(&buf, &len, &cap, curr->exported ? 'x' : 'v', curr->var, curr->val);
+    }
+    ok = ok && journal_add_entry(&buf, &len, &cap, 'c', "", journal->cwd) && journal_add_settings(&buf, &len, &cap);
+    journal->settings_generation = options.settings_generation;
+
+    char path[PATH_MAX + 16];
+    char temp[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s.snap", journal->path);
+    snprintf(temp, sizeof(temp), "%s.snap.tmp", journal->path);
+    int fd = ok ? open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (fd >= 0)
+    {
+        ok = journal_write_record(fd, &buf, len, offset, options.line_number, exit_code) == 0 && fsync(fd) == 0;
+        close(fd);
+        ok = ok && rename(temp, path) == 0;
+    }
+    free(buf);
+    if (fd == -1 || !ok)
+    {
+        fprintf(stderr, "Error: could not write journal snapshot\n");
+        unlink(temp);
+        return -1;
+    }
+
+    // Records before the snapshot are covered by it
+    if (ftruncate(journal->fd, 0) == -1 || fsync(journal->fd) == -1)
+    {
+        return -1;
+    }
+    journal->records = 0;
+    journal->pending = 0;
+    journal->last_sync_ns = monotonic_ns();
+    return 0;
+}
+
+// Helper Method: record a completed line (script offset after it, exit code and what changed)
+void journal_line(Journal *journal, LocalVariableList *local, uint64_t offset, int exit_code)
+{
+    char cwd[PATH_MAX];
+    int cwd_changed = getcwd(cwd, sizeof(cwd)) != NULL && strcmp(cwd, journal->cwd) != 0;
+    if (cwd_changed)
+    {
+        strcpy(journal->cwd, cwd);
+    }
+    if (journal->records >= JOURNAL_SNAPSHOT_RECORDS)
+    {
+        journal_snapshot(journal, local, offset, exit_code);
+        local->changed_count = 0;
+        for (LocalVariable *curr = local->head; curr != NULL; curr = curr->next)
+        {
+            curr->changed = 0;
+        }
+        return;
+    }
+
+    char *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    int ok = 1;
+    for (int i = 0; i < local->changed_count; i++)
+    {
+        LocalVariable *variable = local->changed[i];
+        ok = ok && journal_add_entry(&buf, &len, &cap, variable->exported ? 'x' : 'v', variable->var, variable->val);
+        variable->changed = 0;
+    }
+    local->changed_count = 0;
+    if (cwd_changed)
+    {
+        ok = ok && journal_add_entry(&buf, &len, &cap, 'c', "", cwd);
+    }
+    if (journal->settings_generation != options.settings_generation)
+    {
+        ok = ok && journal_add_settings(&buf, &len, &cap);
+        journal->settings_generation = options.settings_generation;
+    }
+    if (!ok || journal_write_record(journal->fd, &buf, len, offset, options.line_number, exit_code) == -1)
+    {
+        fprintf(stderr, "Error: could not write journal\n");
+    }
+    free(buf);
+    journal->records++;
+
+    // Sync in batches, bounded by count and by time
+    journal->pending++;
+    long long now = monotonic_ns();
+    if (journal->pending >= JOURNAL_SYNC_RECORDS || now - journal->last_sync_ns >= JOURNAL_SYNC_NS)
+    {
+        fdatasync(journal->fd);
+        journal->pending = 0;
+        journal->last_sync_ns = now;
+    }
+}
+
+// Helper Method: apply the valid records in buf, returns the bytes consumed (a torn tail is left out)
+// Records at or before skip_line are already covered by the snapshot
+size_t journal_apply(char *buf, size_t size, uint64_t skip_line, LocalVariableList *local, Journal *journal)
+{
+    size_t pos = 0;
+    while (pos + sizeof(JournalRecord) <= size)
+    {
+        JournalRecord header;
+        memcpy(&header, buf + pos, sizeof(header));
+        char *payload = buf + pos + sizeof(header);
+        if (header.magic != JOURNAL_MAGIC || header.length > size - pos - sizeof(header) ||
+            header.checksum != hash_bytes(payload, header.length))
+        {
+            break;
+        }
+        pos += sizeof(header) + header.length;
+        if (header.line <= skip_line && skip_line > 0)
+        {
+            continue;
+        }
+
+        char *end = payload + header.length;
+        while (payload < end)
+        {
+            char kind = *payload++;
+            char *name = payload;
+            char *value = name + strlen(name) + 1;
+            payload = value + strlen(value) + 1;
+            if (kind == 'c')
+            {
+                if (chdir(value) == 0)
+                {
+                    snprintf(journal->cwd, sizeof(journal->cwd), "%s", value);
+                }
+            }
+            else if (kind == 'v' || kind == 'x')
+            {
+                set_variable(local, name, value, kind == 'x');
+            }
+            else
+            {
+                journal_apply_setting(kind, name, value);
+            }
+        }
+        journal->resume_offset = header.offset;
+        journal->resume_rc = header.exit_code;
+        options.line_number = header.line;
+    }
+    return pos;
+}
+
+// Helper Method: read a whole file into memory (NULL and size 0 if missing)
+char *read_whole_file(const char *path, size_t *size)
+{
+    *size = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    char *buf = malloc(st.st_size + 1);
+    if (buf != NULL && pread(fd, buf, st.st_size, 0) == st.st_size)
+    {
+        *size = st.st_size;
+    }
+    close(fd);
+    return buf;
+}
+
+// Helper Method: path made absolute against the current directory (malloced), NULL on failure
+char *absolute_path(const char *path)
+{
+    char cwd[PATH_MAX];
+    if (path[0] == '/')
+    {
+        return strdup(path);
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        return NULL;
+    }
+    char *absolute = malloc(strlen(cwd) + strlen(path) + 2);
+    if (absolute != NULL)
+    {
+        sprintf(absolute, "%s/%s", cwd, path);
+    }
+    return absolute;
+}
+
+// Helper Method: open the journal, with resume restore the snapshot and replay the records after it
+int open_journal(Journal *journal, LocalVariableList *local, int resume)
+{
+    // The script may cd, snapshots must still land next to the journal
+    char *absolute = absolute_path(journal->path);
+    if (absolute == NULL)
+    {
+        fprintf(stderr, "Error: could not resolve journal path %s\n", journal->path);
+        return -1;
+    }
+    journal->path = absolute;
+    char snap_path[PATH_MAX + 16];
+    snprintf(snap_path, sizeof(snap_path), "%s.snap", journal->path);
+    size_t kept = 0;
+    if (resume)
+    {
+        size_t snap_size;
+        size_t journal_size;
+        char *snap = read_whole_file(snap_path, &snap_size);
+        char *records = read_whole_file(journal->path, &journal_size);
+        journal_apply(snap, snap_size, 0, local, journal);
+        kept = journal_apply(records, journal_size, options.line_number, local, journal);
+        free(snap);
+        free(records);
+    }
+    else
+    {
+        unlink(snap_path);
+    }
+
+    journal->fd = move_fd_high(open(journal->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    if (journal->fd == -1 || ftruncate(journal->fd, kept) == -1 || lseek(journal->fd, 0, SEEK_END) == -1)
+    {
+        fprintf(stderr, "Error: could not open journal %s\n", journal->path);
+        return -1;
+    }
+    // Appends from here on (a torn record from a crash was cut off above)
+    fcntl(journal->fd, F_SETFL, O_APPEND);
+    if (getcwd(journal->cwd, sizeof(journal->cwd)) == NULL)
+    {
+        journal->cwd[0] = '\0';
+    }
+    local->track_changes = 1;
+    journal->last_sync_ns = monotonic_ns();
+    return 0;
+}
+
+// Helper Method: find or add the profile entry for a line in the current call context
+// Script lines are dense, so each context keeps its entries in an array indexed by line
+ProfileEntry *profile_entry(Profiler *profile, long line, const char *command, int command_len)
+{
+    if (profile->context < 0 || line < 0)
+    {
+        return NULL;
+    }
+    ProfileContext *context = &profile->contexts[profile->context];
+    if (line >= context->line_cap)
+    {
+        long cap = context->line_cap ? context->line_cap : PROFILE_MIN_LINES;
+        while (cap <= line)
+        {
+            cap *= 2;
+        }
+        ProfileEntry **lines = realloc(context->lines, cap * sizeof(ProfileEntry *));
+        if (lines == NULL)
+        {
+            return NULL;
+        }
+        memset(lines + context->line_cap, 0, (cap - context->line_cap) * sizeof(ProfileEntry *));
+        context->lines = lines;
+        context->line_cap = cap;
+    }
+    if (context->lines[line] != NULL)
+    {
+        return context->lines[line];
+    }
+
+    if (profile->pool_left == 0)
+    {
+        profile->pool = calloc(PROFILE_POOL_ENTRIES, sizeof(ProfileEntry));
+        profile->pool_left = profile->pool != NULL ? PROFILE_POOL_ENTRIES : 0;
+    }
+    if (profile->arena_left < (size_t)command_len + 1)
+    {
+        size_t size = command_len + 1 > PROFILE_ARENA_BYTES ? command_len + 1 : PROFILE_ARENA_BYTES;
+        profile->arena = malloc(size);
+        profile->arena_left = profile->arena != NULL ? size : 0;
+    }
+    if (profile->pool_left == 0 || profile->arena_left == 0)
+    {
+        return NULL;
+    }
+    ProfileEntry *entry = profile->pool++;
+    profile->pool_left--;
+    entry->command = profile->arena;
+    memcpy(entry->command, command, command_len);
+    entry->command[command_len] = '\0';
+    profile->arena += command_len + 1;
+    profile->arena_left -= command_len + 1;
+    entry->context = context->name;
+    entry->line = line;
+    context->lines[line] = entry;
+    profile->count++;
+    return entry;
+}
+
+// Helper Method: start timing a script line, returns the state profile_end_line needs
+ProfileMark profile_begin_line(Profiler *profile, long line, const char *input)
+{
+    // The first word names the line in the report
+    const char *command = input + strspn(input, " ");
+    ProfileMark mark = {profile_entry(profile, line, command, strcspn(command, " ")), profile->current, monotonic_ns(),
+                        profile->child_wall_ns, profile->child_cpu_ns, profile->nested_ns, profile->nested_child_ns,
+                        profile->nested_cpu_ns};
+    profile->current = mark.entry;
+    return mark;
+}
+
+// Helper Method: charge a finished line with its own time, lines it ran (source) are charged separately
+void profile_end_line(Profiler *profile, ProfileMark *mark)
+{
+    long long total = monotonic_ns() - mark->start_ns;
+    long long child = profile->child_wall_ns - mark->child_wall_ns;
+    long long cpu = profile->child_cpu_ns - mark->child_cpu_ns;
+    long long nested = profile->nested_ns - mark->nested_ns;
+    long long nested_child = profile->nested_child_ns - mark->nested_child_ns;
+    long long nested_cpu = profile->nested_cpu_ns - mark->nested_cpu_ns;
+    if (mark->entry != NULL)
+    {
+        mark->entry->count++;
+        mark->entry->shell_ns += (total - child) - (nested - nested_child);
+        mark->entry->child_ns += child - nested_child;
+        mark->entry->cpu_ns += cpu - nested_cpu;
+    }
+    profile->nested_ns += total;
+    profile->nested_child_ns += child;
+    profile->nested_cpu_ns += cpu;
+    profile->current = mark->previous;
+}
+
+// Helper Method: enter a new call context (a sourced file) under the line being run
+// Returns the context to hand back to profile_pop_context
+int profile_push_context(Profiler *profile, const char *name)
+{
+    int previous = profile->context;
+    char frame[PATH_MAX * 2];
+    if (previous < 0)
+    {
+        snprintf(frame, sizeof(frame), "%s", name);
+    }
+    else
+    {
+        snprintf(frame, sizeof(frame), "%s;%ld: %s;%s", profile->contexts[previous].name,
+                 profile->current != NULL ? profile->current->line : 0,
+                 profile->current != NULL ? profile->current->command : "", name);
+    }
+    for (int i = 0; i < profile->context_count; i++)
+    {
+        if (strcmp(profile->contexts[i].name, frame) == 0)
+        {
+            profile->context = i;
+            return previous;
+        }
+    }
+    if (profile->context_count == profile->context_cap)
+    {
+        int cap = profile->context_cap ? profile->context_cap * 2 : 8;
+        ProfileContext *contexts = realloc(profile->contexts, cap * sizeof(ProfileContext));
+        if (contexts == NULL)
+        {
+            return previous;
+        }
+        profile->contexts = contexts;
+        profile->context_cap = cap;
+    }
+    ProfileContext *context = &profile->contexts[profile->context_count];
+    if ((context->name = strdup(frame)) == NULL)
+    {
+        return previous;
+    }
+    context->lines = NULL;
+    context->line_cap = 0;
+    profile->context = profile->context_count++;
+    return previous;
+}
+
+// Helper Method: leave a call context
+void profile_pop_context(Profiler *profile, int previous)
+{
+    profile->context = previous;
+}
+
+// Helper Method: append a folded stack line (context;line: command;leaf microseconds) to the output buffer
+// printf style formatting dominated writing 100k line profiles, lines are assembled by hand instead
+void profile_write_stack(FILE *out, ProfileEntry *entry, const char *leaf, long long us)
+{
+    char line[PATH_MAX * 2 + MAXLINE];
+    size_t context_len = strlen(entry->context);
+    size_t command_len = strlen(entry->command);
+    size_t leaf_len = strlen(leaf);
+    if (context_len + command_len + leaf_len + 64 > sizeof(line))
+    {
+        return;
+    }
+    char *dest = line;
+    memcpy(dest, entry->context, context_len);
+    dest += context_len;
+    *dest++ = ';';
+    dest += format_decimal(dest, entry->line);
+    *dest++ = ':';
+    *dest++ = ' ';
+    memcpy(dest, entry->command, command_len);
+    dest += command_len;
+    *dest++ = ';';
+    memcpy(dest, leaf, leaf_len);
+    dest += leaf_len;
+    *dest++ = ' ';
+    dest += format_decimal(dest, us);
+    *dest++ = '\n';
+    fwrite(line, 1, dest - line, out);
+}
+
+// Helper Method: write folded stacks (microseconds of shell and child time per line) and print the top lines
+void profile_finish(Profiler *profile)
+{
+    FILE *out = fopen(profile->path, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Error: could not write profile %s\n", profile->path);
+        return;
+    }
+    static char out_buf[1 << 20];
+    setvbuf(out, out_buf, _IOFBF, sizeof(out_buf));
+
+    // One pass writes the stacks and keeps the largest lines in order, no full sort needed
+    ProfileEntry *top[PROFILE_TOP_LINES];
+    int top_count = 0;
+    long long total = 0;
+    for (int i = 0; i < profile->context_count; i++)
+    {
+        for (long line = 0; line < profile->contexts[i].line_cap; line++)
+        {
+            ProfileEntry *entry = profile->contexts[i].lines[line];
+            if (entry == NULL)
+            {
+                continue;
+            }
+            if (entry->shell_ns / 1000 > 0)
+            {
+                profile_write_stack(out, entry, "shell", entry->shell_ns / 1000);
+            }
+            if (entry->child_ns / 1000 > 0)
+            {
+                profile_write_stack(out, entry, "child", entry->child_ns / 1000);
+            }
+            long long entry_total = entry->shell_ns + entry->child_ns;
+            total += entry_total;
+            int pos = top_count < PROFILE_TOP_LINES ? top_count++ : PROFILE_TOP_LINES;
+            while (pos > 0 && top[pos - 1]->shell_ns + top[pos - 1]->child_ns < entry_total)
+            {
+                if (pos < PROFILE_TOP_LINES)
+                {
+                    top[pos] = top[pos - 1];
+                }
+                pos--;
+            }
+            if (pos < PROFILE_TOP_LINES)
+            {
+                top[pos] = entry;
+            }
+        }
+    }
+    fclose(out);
+
+    fprintf(stderr, "profile: %d lines, %.3f s, written to %s\n", profile->count, total / 1e9, profile->path);
+    fprintf(stderr, "%10s %10s %10s %10s %8s  %s\n", "total ms", "shell ms", "child ms", "cpu ms", "count", "line");
+    for (int i = 0; i < top_count; i++)
+    {
+        ProfileEntry *entry = top[i];
+        fprintf(stderr, "%10.3f %10.3f %10.3f %10.3f %8ld  %s:%ld %s\n", (entry->shell_ns + entry->child_ns) / 1e6,
+                entry->shell_ns / 1e6, entry->child_ns / 1e6, entry->cpu_ns / 1e6, entry->count, entry->context, entry->line,
+                entry->command);
+    }
+}
+
+void batch_loop(char *file_name, LocalVariableList *local, History *history)
+{
+    int prev_rc = 0;
+    char input[MAXLINE];
+    // The script stays open above the descriptors exec hands out
+    int script_fd = move_fd_high(open(file_name, O_RDONLY | O_CLOEXEC));
+    FILE *file = script_fd >= 0 ? fdopen(script_fd, "r") : NULL;
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: Could not access file: %s\n", file_name);
+        exit(1);
+    }
+    if (options.profile.path != NULL)
+    {
+        profile_push_context(&options.profile, file_name);
+    }
+    // Resume after the last line the journal saw complete
+    if (options.journal.resume_offset > 0)
+    {
+        fseek(file, options.journal.resume_offset, SEEK_SET);
+        prev_rc = options.journal.resume_rc;
     }
-    if (strcmp(args[0], "exit") == 0)
+    // Loop through lines of file
+    while (fgets(input, sizeof(input), file) != NULL)
     {
-        if (arg_count == 1)
+        // Piazza recommended
+        fflush(stdout);
+        // Remove newline (incase)
+        input[strcspn(input, "\n")] = '\0';
+        options.line_number++;
+        // Handle and breakdown argument
+        if (options.profile.path != NULL)
         {
-            built_in_exit(local, history, prev_rc, file);
+            ProfileMark mark = profile_begin_line(&options.profile, options.line_number, input);
+            prev_rc = handle_argument(input, local, history, prev_rc, file);
+            profile_end_line(&options.profile, &mark);
         }
         else
         {
-            fprintf(stderr, "Error: Inproper exit arguments\n");
-            return 1;
+            prev_rc = handle_argument(input, local, history, prev_rc, file);
+        }
+        if (options.journal.fd >= 0)
+        {
+            journal_line(&options.journal, local, ftell(file), prev_rc);
         }
     }
-    if (strcmp(args[0], "cd") == 0)
+    built_in_exit(local, history, prev_rc, file);
+}
+
+// Helper Method: send a script request with stdin/stdout/stderr attached (SCM_RIGHTS)
+// https://man7.org/linux/man-pages/man7/unix.7.html
+int send_server_request(int sock, char *payload, size_t payload_len)
+{
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+
+    struct iovec iov = {payload, payload_len};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    return sendmsg(sock, &msg, 0) == (ssize_t)payload_len ? 0 : -1;
+}
+
+// Helper Method: receive a script request, fds gets the client's stdin/stdout/stderr
+int recv_server_request(int conn, char *payload, size_t payload_size, int fds[3])
+{
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec iov = {payload, payload_size - 1};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (got <= 0)
     {
-        return built_in_cd(args, arg_count);
+        return -1;
     }
-    if (strcmp(args[0], "export") == 0)
+    payload[got] = '\0';
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3))
     {
-        return built_in_export(args, arg_count);
+        return -1;
     }
-    if (strcmp(args[0], "local") == 0)
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+    return 0;
+}
+
+// Helper Method: fill in a unix socket address
+int server_address(char *socket_path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path))
     {
-        return built_in_local(args, arg_count, local);
+        fprintf(stderr, "Error: socket path too long: %s\n", socket_path);
+        return -1;
     }
-    if (strcmp(args[0], "vars") == 0)
+    strcpy(addr->sun_path, socket_path);
+    return 0;
+}
+
+// Resident server: this process stays initialized and forks a worker per script request
+void run_server(char *socket_path, LocalVariableList *local, History *history)
+{
+    struct sockaddr_un addr;
+    if (server_address(socket_path, &addr) == -1)
     {
-        return built_in_vars(arg_count, local);
+        exit(1);
     }
-    if (strcmp(args[0], "history") == 0)
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
     {
-        return built_in_history(args, arg_count, redirect, local, history, prev_rc, file);
+        fprintf(stderr, "Error: could not create server socket\n");
+        exit(1);
     }
-    if (strcmp(args[0], "ls") == 0)
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, SOMAXCONN) == -1)
     {
-        return built_in_ls(arg_count);
+        fprintf(stderr, "Error: could not listen on %s\n", socket_path);
+        exit(1);
     }
-    // Not built in function! Do following:
-
-    // https://git.doit.wisc.edu/cdis/cs/courses/cs537/fall24/public/discussion_material/-/blob/main/week3/fork_exec.c?ref_type=heads
 
-    HistoryItem *newItem = create_history_item(args, arg_count);
-    if (newItem == NULL)
+    // Finished workers are reaped through a signalfd in the same poll loop
+    sigset_t chld_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, NULL);
+    int sig_fd = signalfd(-1, &chld_mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sig_fd == -1)
     {
-        // Error recorded and frees made already
-        restore_fd_free_redirect(redirect, in_d, out_d, err_d);
-        return 1;
+        fprintf(stderr, "Error: could not create signalfd\n");
+        exit(1);
     }
 
-    add_history_item(history, newItem);
+    // Worker pid -> client connection waiting for its exit code
+    pid_t *worker_pids = NULL;
+    int *worker_conns = NULL;
+    int worker_count = 0;
+    int worker_cap = 0;
 
-    // Create fork to exec command
-    // https://linux.die.net/man/2/access
-    char *new_path = NULL;
-    char *path = NULL;
-    int status;
-    pid_t rc, w;
-    rc = fork();
-    if (rc < 0)
-    {
-        // Fork failed
-        fprintf(stderr, "Error: Fork failed\n");
-        restore_fd_free_redirect(redirect, in_d, out_d, err_d);
-        return 1;
-    }
-    else if (rc == 0)
+    while (1)
     {
-        // Child Process
-        // Check check execute access of args
-        if (access(args[0], X_OK) == 0)
+        struct pollfd pfds[2] = {{listen_fd, POLLIN, 0}, {sig_fd, POLLIN, 0}};
+        if (poll(pfds, 2, -1) == -1)
         {
-            exit(execv(args[0], args));
+            continue;
         }
-        else
-        {
-            // Get env var Path 
-            char *path_pointer = getenv("PATH");
-            if (path_pointer == NULL)
-            {
-                exit(-1);
-            }
 
-            path = malloc(strlen(path_pointer) + 1);
-            if (path == NULL)
+        if (pfds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            while (read(sig_fd, &info, sizeof(info)) == sizeof(info))
             {
-                exit(-1);
             }
-            strcpy(path, path_pointer);
-
-            // Split by :
-            char *token = strtok(path, ":");
-
-            while (token != NULL)
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
             {
-                // Get path of token and arged func concated
-                new_path = malloc(strlen(token) + strlen(args[0]) + 2);
-                if (new_path == NULL)
-                {
-                    exit(-1);
-                }
-
-                // dest, source: dest <-- dest + source
-                strcpy(new_path, token);
-                strcat(new_path, "/");
-                strcat(new_path, args[0]);
-
-                // Try access on new path
-                if (access(new_path, X_OK) == 0)
+                for (int i = 0; i < worker_count; i++)
                 {
-                    exit(execv(new_path, args));
+                    if (worker_pids[i] != pid)
+                    {
+                        continue;
+                    }
+                    int32_t code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                    // The client may be gone already, that must not take the server down with SIGPIPE
+                    if (send(worker_conns[i], &code, sizeof(code), MSG_NOSIGNAL) != sizeof(code))
+                    {
+                        fprintf(stderr, "Error: could not report exit code to client\n");
+                    }
+                    close(worker_conns[i]);
+                    worker_pids[i] = worker_pids[--worker_count];
+                    worker_conns[i] = worker_conns[worker_count];
+                    break;
                 }
-                token = strtok(NULL, ":");
             }
-            // No path found
-            exit(-1);
         }
-    }
-    else
-    {
-        // Parent Process
-        // https://stackoverflow.com/questions/47441871/why-should-we-check-wifexited-after-wait-in-order-to-kill-child-processes-in-lin
-        w = waitpid(rc, &status, 0);
-        if (w == -1)
+
+        if (!(pfds[0].revents & POLLIN))
         {
-            // Waitpid failure
-            fprintf(stderr, "Error: waitpid failure\n");
-            restore_fd_free_redirect(redirect, in_d, out_d, err_d);
-            free(path);
-            free(new_path);
-            return 1;
+            continue;
         }
-        if (WIFEXITED(status))
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1)
         {
-            // Succesful child exit
-            int child_rc = WEXITSTATUS(status);
-            restore_fd_free_redirect(redirect, in_d, out_d, err_d);
-            free(path);
-            free(new_path);
-            return child_rc;
+            continue;
         }
-        else
+
+        if (worker_count == worker_cap)
         {
-            // Failed child exit
-            fprintf(stderr, "Error: Child process failed exit\n");
-            restore_fd_free_redirect(redirect, in_d, out_d, err_d);
-            free(path);
-            free(new_path);
-            return 1;
+            worker_cap = worker_cap ? worker_cap * 2 : 16;
+            pid_t *grown_pids = realloc(worker_pids, sizeof(pid_t) * worker_cap);
+            if (grown_pids != NULL)
+            {
+                worker_pids = grown_pids;
+            }
+            int *grown_conns = realloc(worker_conns, sizeof(int) * worker_cap);
+            if (grown_conns != NULL)
+            {
+                worker_conns = grown_conns;
+            }
+            if (grown_pids == NULL || grown_conns == NULL)
+            {
+                fprintf(stderr, "Error: could not track worker\n");
+                exit(1);
+            }
         }
-    }
-}
 
-int handle_argument(char *input, LocalVariableList *local, History *history, int prev_rc, FILE *file)
-{
-    char *token;
-    char *args[MAXARGS];
-    // Get args via tokens
-    token = strtok(input, " ");
-    // Handle comment:
-    if (token[0] != '#')
-    {
-        // Loop other tokens
-        int arg_count = 0;
-        while (token != NULL && arg_count < MAXARGS - 1)
+        pid_t pid = fork();
+        if (pid == 0)
         {
-            // Replace $<var> with local var
-            if (token[0] == '$')
+            // Worker: shell state is already initialized, adopt the client's fds and run
+            sigprocmask(SIG_UNBLOCK, &chld_mask, NULL);
+            close(listen_fd);
+            close(sig_fd);
+            // The request is read here, a client that is slow to send it only holds up its own worker
+            // Request is "cwd\0script\0" with the client's three standard fds attached
+            char payload[PATH_MAX * 2 + 2];
+            int fds[3];
+            if (recv_server_request(conn, payload, sizeof(payload), fds) == -1)
             {
-                // Crop out '$'
-                args[arg_count] = replace_var(token + 1, local);
-                if (args[arg_count] == NULL)
+                fprintf(stderr, "Error: malformed client request\n");
+                exit(1);
+            }
+            close(conn);
+            char *cwd = payload;
+            char *script = payload + strlen(payload) + 1;
+            for (int i = 0; i < 3; i++)
+            {
+                if (dup2(fds[i], i) == -1)
                 {
-                    fprintf(stderr, "Error: count not allocate empty\n");
-                    prev_rc = 1;
-                    break;
+                    exit(1);
                 }
+                close(fds[i]);
             }
-            else
+            if (cwd[0] != '\0' && chdir(cwd) != 0)
             {
-                // Save token into args
-                args[arg_count] = token;
+                fprintf(stderr, "Error: could not change to %s\n", cwd);
+                exit(1);
             }
-
-            // Get next token
-            arg_count++;
-            token = strtok(NULL, " ");
+            batch_loop(script, local, history);
+        }
+        if (pid < 0)
+        {
+            fprintf(stderr, "Error: Fork failed\n");
+            close(conn);
+            continue;
         }
+        worker_pids[worker_count] = pid;
+        worker_conns[worker_count] = conn;
+        worker_count++;
+    }
+}
 
-        // Terminate args (just in case)
-        args[arg_count] = NULL;
+// Thin client: forward script and standard fds to a server, exit with the script's code
+int run_client(char *socket_path, char *script)
+{
+    struct sockaddr_un addr;
+    if (server_address(socket_path, &addr) == -1)
+    {
+        return 1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        fprintf(stderr, "Error: could not connect to %s\n", socket_path);
+        return 1;
+    }
 
-        // Scrape redirect
-        struct Redirect *redirect = malloc(sizeof(Redirect));
-        if (redirect == NULL)
+    char payload[PATH_MAX * 2 + 2];
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        cwd[0] = '\0';
+    }
+    size_t cwd_len = strlen(cwd) + 1;
+    size_t script_len = strlen(script) + 1;
+    if (script_len > PATH_MAX)
+    {
+        fprintf(stderr, "Error: script path too long\n");
+        return 1;
+    }
+    memcpy(payload, cwd, cwd_len);
+    memcpy(payload + cwd_len, script, script_len);
+    if (send_server_request(sock, payload, cwd_len + script_len) == -1)
+    {
+        fprintf(stderr, "Error: could not send request\n");
+        return 1;
+    }
+
+    int32_t code;
+    ssize_t got = 0;
+    while (got < (ssize_t)sizeof(code))
+    {
+        ssize_t n = read(sock, (char *)&code + got, sizeof(code) - got);
+        if (n <= 0)
         {
-            fprintf(stderr, "Error: could not malloc redirect\n");
+            fprintf(stderr, "Error: server closed connection\n");
             return 1;
         }
-        redirect->last_arg = args[arg_count - 1];
-        redirect->redirect_type = NR;
+        got += n;
+    }
+    close(sock);
+    return code;
+}
 
-        if (strstr(redirect->last_arg, "&>>") != NULL)
+// Helper Method: print command line usage
+void print_usage(char *name)
+{
+    fprintf(stderr, "Usage: %s [--capture DIR] [--cmd-timeout DURATION] [batch_file]\n", name);
+    fprintf(stderr, "       %s [--journal FILE [--resume]] [--profile FILE] batch_file\n", name);
+    fprintf(stderr, "       %s [--capture DIR] [--cmd-timeout DURATION] --server SOCKET\n", name);
+    fprintf(stderr, "       %s --client SOCKET batch_file\n", name);
+    fprintf(stderr, "       %s --capture-read DIR [line]\n", name);
+}
+
+// Handle startup types: Interactive (user) or Batch (file)
+int main(int argc, char **argv)
+{
+    // Thin client and capture reader need no shell state of their own
+    if (argc >= 2 && strcmp(argv[1], "--client") == 0)
+    {
+        if (argc != 4)
         {
-            redirect->redirect_type = ASOSE;
+            print_usage(argv[0]);
+            exit(1);
         }
-        else if (strstr(redirect->last_arg, "&>") != NULL)
+        return run_client(argv[2], argv[3]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--capture-read") == 0)
+    {
+        if (argc != 3 && argc != 4)
         {
-            redirect->redirect_type = RSOSE;
+            print_usage(argv[0]);
+            exit(1);
         }
-        else if (strstr(redirect->last_arg, ">>") != NULL)
+        return read_capture(argv[2], argc == 4 ? argv[3] : NULL);
+    }
+
+    // Options first, a remaining argument is the batch file
+    char *batch_file = NULL;
+    char *server_socket = NULL;
+    int resume = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc)
         {
-            redirect->redirect_type = ARO;
+            server_socket = argv[++i];
         }
-        else if (strstr(redirect->last_arg, ">") != NULL)
+        else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
         {
-            redirect->redirect_type = RO;
+            options.capture_dir = argv[++i];
         }
-        else if (strstr(redirect->last_arg, "<") != NULL)
+        else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc)
         {
-            redirect->redirect_type = RI;
+            options.journal.path = argv[++i];
         }
-        int rc = handle_command(args, arg_count, redirect, local, history, prev_rc, file);
-        free(redirect);
-        return rc;
-    }
-    return prev_rc;
-}
-
-void interactive_loop(LocalVariableList *local, History *history)
-{
-    int prev_rc = 0;
-    char input[MAXLINE];
-    FILE *file = NULL;
-    while (1)
-    {
-        // Prompt user
-        printf("barber> ");
-        // Piazza recommended
-        fflush(stdout);
-        // Get input line
-        if (fgets(input, sizeof(input), stdin) == NULL)
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
         {
-            built_in_exit(local, history, prev_rc, file);
+            options.profile.path = argv[++i];
         }
-        // Handle ctrl-d input
-        if (feof(stdin))
+        else if (strcmp(argv[i], "--resume") == 0)
         {
-            built_in_exit(local, history, prev_rc, file);
+            resume = 1;
+        }
+        else if (strcmp(argv[i], "--cmd-timeout") == 0 && i + 1 < argc)
+        {
+            if (parse_duration(argv[++i], &options.cmd_timeout_ns) == -1)
+            {
+                fprintf(stderr, "Error: invalid timeout duration %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (argv[i][0] != '-' && batch_file == NULL)
+        {
+            batch_file = argv[i];
+        }
+        else
+        {
+            print_usage(argv[0]);
+            exit(1);
         }
-        // Remove newline (incase)
-        input[strcspn(input, "\n")] = '\0';
-        // Handle and breakdown argument
-        prev_rc = handle_argument(input, local, history, prev_rc, file);
     }
-}
-
-void batch_loop(char *file_name, LocalVariableList *local, History *history)
-{
-    int prev_rc = 0;
-    char input[MAXLINE];
-    FILE *file = fopen(file_name, "r");
-    if (file == NULL)
+    if (options.capture_dir != NULL && open_capture(options.capture_dir, &options.capture) == -1)
     {
-        fprintf(stderr, "Error: Could not access file: %s\n", file_name);
         exit(1);
     }
-    // Loop through lines of file
-    while (fgets(input, sizeof(input), file) != NULL)
+    if (options.profile.path != NULL && batch_file == NULL)
     {
-        // Piazza recommended
-        fflush(stdout);
-        // Remove newline (incase)
-        input[strcspn(input, "\n")] = '\0';
-        // Handle and breakdown argument
-        prev_rc = handle_argument(input, local, history, prev_rc, file);
+        fprintf(stderr, "Error: --profile needs a batch file\n");
+        exit(1);
+    }
+    // The profile is written on exit, after the script may have changed directory
+    if (options.profile.path != NULL && (options.profile.path = absolute_path(options.profile.path)) == NULL)
+    {
+        fprintf(stderr, "Error: could not resolve profile path\n");
+        exit(1);
+    }
+    if ((options.journal.path != NULL || resume) && (batch_file == NULL || server_socket != NULL || options.journal.path == NULL))
+    {
+        fprintf(stderr, "Error: --journal and --resume need a batch file\n");
+        exit(1);
     }
-    built_in_exit(local, history, prev_rc, file);
-}
 
-// Handle startup types: Interactive (user) or Batch (file)
-int main(int argc, char **argv)
-{
+    // SIGUSR1 dumps the trace ring (restarting reads so the script is not disturbed)
+    struct sigaction dump_action;
+    memset(&dump_action, 0, sizeof(dump_action));
+    dump_action.sa_handler = trace_signal;
+    dump_action.sa_flags = SA_RESTART;
+    sigemptyset(&dump_action.sa_mask);
+    sigaction(SIGUSR1, &dump_action, NULL);
+
     // Set correct path
     if (setenv("PATH", "/bin", 1) == -1)
     {
@@ -1074,6 +7924,31 @@ int main(int argc, char **argv)
     local->head = NULL;
     local->end = NULL;
     local->size = 0;
+    local->envp = NULL;
+    local->envp_count = 0;
+    local->envp_cap = 0;
+    local->track_changes = 0;
+    local->changed = NULL;
+    local->changed_count = 0;
+    local->changed_cap = 0;
+    if (!import_environment(local))
+    {
+        fprintf(stderr, "Error: could not import environment\n");
+        free_local_variables(local);
+        exit(1);
+    }
+
+    // Journal restores variables and the directory before the first line runs, so the script path is resolved first
+    if (options.journal.path != NULL && (batch_file = absolute_path(batch_file)) == NULL)
+    {
+        fprintf(stderr, "Error: could not resolve script path\n");
+        exit(1);
+    }
+    if (options.journal.path != NULL && open_journal(&options.journal, local, resume) == -1)
+    {
+        free_local_variables(local);
+        exit(1);
+    }
 
     // Init history storage
     History *history = malloc(sizeof(History));
@@ -1084,22 +7959,29 @@ int main(int argc, char **argv)
         exit(1);
     }
     history->head = NULL;
+    history->tail = NULL;
     history->size = 0;
     history->max = 5;
+    history->next_id = 0;
+    history->clock = 0;
+    history->max_uses = 1;
+    history->recent = NULL;
+    history->line_table = NULL;
+    history->line_slots = 0;
+    history->postings = NULL;
+    history->posting_slots = 0;
+    history->posting_used = 0;
 
-    if (argc == 1)
+    if (server_socket != NULL)
     {
-        interactive_loop(local, history);
+        run_server(server_socket, local, history);
     }
-    else if (argc == 2)
+    else if (batch_file != NULL)
     {
-        batch_loop(argv[1], local, history);
+        batch_loop(batch_file, local, history);
     }
     else
     {
-        fprintf(stderr, "Usage: %s [batch_file]\n", argv[0]);
-        free(local);
-        free(history);
-        exit(1);
+        interactive_loop(local, history);
     }
 }
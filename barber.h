@@ -1,7 +1,25 @@
-// Default input sizes
+// Default input sizes (argument arrays start at MAXARGS and grow)
 #define MAXLINE 1024
 #define MAXARGS 128
 
+// Glob expansion sizes
+#define DIRCACHE_BUCKETS 256
+
+// History sizes
+#define MAXHISTORY 1000000
+#define HISTORY_SEARCH_LIMIT 20
+#define HISTORY_RECENCY_SCALE 100.0
+
+// Line editor sizes
+#define MAXCOMPLETIONS 200
+#define ESCAPE_TIMEOUT_MS 50
+
+// Line editor keys decoded from escape sequences
+#define KEY_DELETE 256
+#define KEY_WORD_LEFT 257
+#define KEY_WORD_RIGHT 258
+#define KEY_KILL_WORD 259
+
 // Redirecting IDs
 #define NR 0
 #define RI 1
@@ -9,8 +27,83 @@
 #define ARO 3
 #define RSOSE 4
 #define ASOSE 5
+#define HD 6
+#define HS 7
+
+// Redirect limits
+#define MAXREDIRECTS 16
+
+// Watch builtin (quiet period before rerunning, events that count as a change)
+#define WATCH_DEBOUNCE_MS 100
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+// Descriptors exec can set (the shell keeps its own at EXEC_MAXFD and above) and open-file cache size
+#define EXEC_MAXFD 10
+#define FILECACHE_MAX 32
+
+// Sourced files kept parsed per session, and how deeply source may nest
+#define SOURCE_CACHE_MAX 64
+#define SOURCE_MAX_DEPTH 64
+
+// Process substitutions (<(cmd) and >(cmd)) on one command line
+#define MAXSUBSTITUTIONS 16
+
+// Capture index flags
+#define CAPTURE_TIMED_OUT 1
+
+// Timeouts (exit status as in coreutils timeout, SIGTERM to SIGKILL grace)
+#define TIMEOUT_STATUS 124
+#define TIMEOUT_KILL_GRACE_NS 2000000000LL
+// How often a child is polled for exit when no pidfd can be had
+#define TIMEOUT_POLL_MS 10
+
+// Parallel builtin limits (job exit statuses combine like GNU parallel)
+#define MAXPARALLEL 1024
+#define PARALLEL_FAILED_MAX 101
+// Job output held in memory per stream, past this it moves to a memory file
+#define PARALLEL_SPILL_BYTES (1 << 20)
 
-// Includes
+// Argument splitting (bytes of ARG_MAX left unused, as xargs does)
+#define ARGSPLIT_HEADROOM 2048
+// Longest single argument execve takes (MAX_ARG_STRLEN, 32 pages)
+#define ARGSPLIT_MAX_STRLEN (32 * 4096)
+
+// Command cache (default store size, entry magic "BCH1" and hex name length)
+#define CACHE_MAX_BYTES (256ULL * 1024 * 1024)
+#define CACHE_MAGIC 0x31484342u
+#define CACHE_NAME_LEN 32
+
+// Journal (record magic "BJR1", fsync batching and snapshot interval)
+#define JOURNAL_MAGIC 0x31524a42u
+#define JOURNAL_SYNC_RECORDS 64
+#define JOURNAL_SYNC_NS 100000000LL
+#define JOURNAL_SNAPSHOT_RECORDS 10000
+
+// Profiler (lines listed in the summary on exit, allocation block sizes)
+#define PROFILE_TOP_LINES 10
+#define PROFILE_POOL_ENTRIES 4096
+#define PROFILE_MIN_LINES 1024
+#define PROFILE_ARENA_BYTES 65536
+
+// Tracer (commands kept in the ring, bytes of command text kept per command)
+#define TRACE_RECORDS 256
+#define TRACE_TEXT 240
+
+// Resource limit slots set by ulimit and applied in the child before exec
+#define LIMIT_CPU 0
+#define LIMIT_MEMORY 1
+#define LIMIT_FILES 2
+#define LIMIT_COUNT 3
+
+// I/O priority encoding for ioprio_set (no glibc wrapper, values as in linux/ioprio.h)
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_DEFAULT_LEVEL 4
+// Longest CPU list text, every other CPU listed on its own ("0,2,4,...")
+#define CPU_LIST_MAX (CPU_SETSIZE * 5)
+
+// Includes (Linux specific interfaces such as accept4 need _GNU_SOURCE)
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,8 +111,28 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <termios.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <sys/syscall.h>
 
-// Used to print environment variables
+// Used to import environment variables at startup
 extern char **environ;
 
 // Redirection struct
@@ -27,22 +140,84 @@ typedef struct Redirect
 {
     char *last_arg;
     int redirect_type;
+    // Here-document or here-string body (a memfd read from the start, -1 for other redirects)
+    int body_fd;
+    // Trailing words making up the redirect, several > and >> words for one descriptor fan its output out
+    char **words;
+    int word_count;
 } Redirect;
 
-// LocalVariable structure
+// SavedFds structure (descriptors replaced by redirects, restored after the command)
+typedef struct SavedFds
+{
+    int fds[MAXREDIRECTS];
+    int saved[MAXREDIRECTS];
+    int count;
+    // Process copying a fanned out stream to its targets, reaped on restore (0 if none)
+    pid_t pump;
+} SavedFds;
+
+// Substitutions structure (process substitutions of a line, reaped once its command finishes)
+typedef struct Substitutions
+{
+    pid_t pids[MAXSUBSTITUTIONS];
+    // The shell's end of each pipe, the command sees it as /dev/fd/N
+    int fds[MAXSUBSTITUTIONS];
+    char paths[MAXSUBSTITUTIONS][32];
+    int count;
+} Substitutions;
+
+// OpenFile structure (redirect target held open by the open-file cache)
+typedef struct OpenFile
+{
+    char *path;
+    int flags;
+    int fd;
+    // Inotify watch on the inode, file_cache_poll drops the entry once the path stops naming it
+    int watch;
+    // Relative paths only match in the directory they were opened from
+    long cwd_generation;
+    long long used;
+} OpenFile;
+
+// FileCache structure (set -o fdcache, append targets kept open, inotify drops unlinked or moved files)
+typedef struct FileCache
+{
+    OpenFile files[FILECACHE_MAX];
+    int count;
+    int inotify_fd;
+    int enabled;
+    long cwd_generation;
+    long long clock;
+} FileCache;
+
+// LocalVariable structure (shell variable, exported ones also live in envp)
 typedef struct LocalVariable
 {
     char *var;
     char *val;
+    int exported;
+    char *entry;
+    int env_index;
+    // Set while the variable waits in the journal's change list
+    int changed;
     struct LocalVariable *next;
 } LocalVariable;
 
-// LocalVariableList structure
+// LocalVariableList structure (all variables plus the envp handed to execve)
 typedef struct LocalVariableList
 {
     LocalVariable *head;
     LocalVariable *end;
     int size;
+    char **envp;
+    int envp_count;
+    int envp_cap;
+    // Variables set since the last journal record (only kept while journaling)
+    int track_changes;
+    LocalVariable **changed;
+    int changed_count;
+    int changed_cap;
 } LocalVariableList;
 
 // HistoryItem structure
@@ -50,16 +225,424 @@ typedef struct HistoryItem
 {
     char **args;
     int arg_count;
+    char *line;
+    long long id;
+    long long uses;
+    long long last_used;
     struct HistoryItem *next;
+    struct HistoryItem *prev;
+    struct HistoryItem *line_next;
+    // Items used more than once, most recently used first
+    struct HistoryItem *recent_next;
+    struct HistoryItem *recent_prev;
 } HistoryItem;
 
-// History LinkedList structure
+// TrigramPosting structure (history items containing a trigram, oldest first)
+typedef struct TrigramPosting
+{
+    unsigned int trigram;
+    HistoryItem **items;
+    int start;
+    int count;
+    int cap;
+} TrigramPosting;
+
+// History LinkedList structure (newest at head, indexed for search)
 typedef struct History
 {
     struct HistoryItem *head;
+    struct HistoryItem *tail;
     int size;
     int max;
+    long long next_id;
+    long long clock;
+    long long max_uses;
+    HistoryItem *recent;
+    // Exact line lookup for de-duplication
+    HistoryItem **line_table;
+    int line_slots;
+    // Trigram index (open addressing, trigram 0 marks a free slot)
+    TrigramPosting *postings;
+    int posting_slots;
+    int posting_used;
 } History;
 
+// DirListing structure (sorted entries of one directory)
+typedef struct DirListing
+{
+    char *path;
+    char **names;
+    unsigned char *types;
+    char *arena;
+    int count;
+    struct DirListing *next;
+} DirListing;
+
+// DirCache structure (listings read during one command line)
+typedef struct DirCache
+{
+    DirListing *buckets[DIRCACHE_BUCKETS];
+} DirCache;
+
+// GlobMatches structure (paths produced by glob expansion)
+typedef struct GlobMatches
+{
+    char **paths;
+    int count;
+    int cap;
+} GlobMatches;
+
+// TrieNode structure (one character of an executable name)
+typedef struct TrieNode
+{
+    char ch;
+    int terminal;
+    struct TrieNode *child;
+    struct TrieNode *sibling;
+} TrieNode;
+
+// CommandTrie structure (executables on PATH, kept current with inotify)
+typedef struct CommandTrie
+{
+    TrieNode *root;
+    char *path;
+    int inotify_fd;
+    int *watch_ds;
+    char **watch_dirs;
+    int watch_count;
+} CommandTrie;
+
+// LineEditor structure (line editing state, kept across lines)
+typedef struct LineEditor
+{
+    char *buf;
+    int size;
+    int len;
+    int pos;
+    const char *prompt;
+    int last_was_tab;
+    // What the terminal currently shows, for incremental redraw
+    char shown[MAXLINE * 2];
+    int shown_len;
+    int shown_cursor;
+    // Pending input bytes (keys are coalesced before each redraw)
+    char pending[64];
+    int pending_len;
+    int pending_pos;
+    // Kill ring of one entry
+    char kill[MAXLINE];
+    int kill_len;
+    // History navigation and reverse search
+    char saved[MAXLINE];
+    HistoryItem *history_item;
+    int searching;
+    char query[MAXLINE];
+    int query_len;
+    HistoryItem *search_results[HISTORY_SEARCH_LIMIT];
+    int search_count;
+    int search_pos;
+    CommandTrie trie;
+    // Keystroke to echo latency
+    long long key_batches;
+    long long latency_total_ns;
+    long long latency_max_ns;
+} LineEditor;
+
+// CaptureRecord structure (header in front of every output chunk in capture.log)
+typedef struct CaptureRecord
+{
+    uint32_t line;
+    uint32_t length;
+    int64_t timestamp_ns;
+    uint8_t stream;
+    uint8_t pad[7];
+} CaptureRecord;
+
+// CaptureIndexEntry structure (one per captured command in capture.idx)
+typedef struct CaptureIndexEntry
+{
+    uint32_t line;
+    int32_t exit_code;
+    uint64_t offset;
+    uint64_t length;
+    int64_t start_ns;
+    int64_t end_ns;
+    uint32_t flags;
+    uint32_t reserved;
+} CaptureIndexEntry;
+
+// CaptureLog structure (open --capture files)
+typedef struct CaptureLog
+{
+    int log_fd;
+    int index_fd;
+    uint64_t offset;
+} CaptureLog;
+
+// ParallelJob structure (one running job of the parallel builtin)
+typedef struct ParallelJob
+{
+    pid_t pid;
+    // Slot 0 is the job's pidfd, 1 and 2 its stdout and stderr pipes (-1 once closed)
+    int fds[3];
+    int open_count;
+    int status;
+    int timed_out;
+    long long deadline;
+    // Output is held back and written as one group when the job finishes
+    char *output[3];
+    size_t output_len[3];
+    size_t output_cap[3];
+    // Memory file taking output past PARALLEL_SPILL_BYTES (0 when none, the shell's own fds are above EXEC_MAXFD)
+    int spill[3];
+} ParallelJob;
+
+// WatchTarget structure (one inotify watch of the watch builtin, name limits a parent directory watch to one file)
+typedef struct WatchTarget
+{
+    int wd;
+    char *path;
+    char *name;
+} WatchTarget;
+
+// Watcher structure (watch builtin state, directories are watched recursively)
+typedef struct Watcher
+{
+    int inotify_fd;
+    WatchTarget *targets;
+    int count;
+    int cap;
+    // --exclude patterns, matched against entry names (such as the command's own outputs)
+    char **excludes;
+    int exclude_count;
+} Watcher;
+
+// CacheKey structure (two 64 bit hash lanes, 128 bits naming a cache entry)
+typedef struct CacheKey
+{
+    uint64_t a;
+    uint64_t b;
+} CacheKey;
+
+// CacheHeader structure (start of every cache entry, stdout then stderr bytes follow)
+typedef struct CacheHeader
+{
+    uint32_t magic;
+    int32_t exit_code;
+    uint64_t out_len;
+    uint64_t err_len;
+} CacheHeader;
+
+// CacheUse structure (entry seen while evicting)
+typedef struct CacheUse
+{
+    int64_t used;
+    uint64_t size;
+    const char *name;
+} CacheUse;
+
+// JournalRecord structure (header of every journal and snapshot record)
+// Payload entries are a kind byte ('v' variable, 'x' exported variable, 'c' directory), name and value, NUL terminated
+// Settings entries: 'o' set option, 'l' ulimit by flag, 'r' run defaults (hex), 'f' exec descriptor (flags:path or -)
+typedef struct JournalRecord
+{
+    uint32_t magic;
+    uint32_t length;
+    uint32_t checksum;
+    int32_t exit_code;
+    uint64_t offset;
+    uint64_t line;
+} JournalRecord;
+
+// Journal structure (open --journal state)
+typedef struct Journal
+{
+    char *path;
+    int fd;
+    int pending;
+    long long last_sync_ns;
+    long records;
+    char cwd[PATH_MAX];
+    // Where --resume picks up in the script
+    uint64_t resume_offset;
+    int resume_rc;
+    // Settings generation last written, a line that changes settings journals all of them
+    long settings_generation;
+} Journal;
+
+// ProfileEntry structure (time spent on one script line in one call context)
+typedef struct ProfileEntry
+{
+    const char *context;
+    long line;
+    char *command;
+    long count;
+    long long shell_ns;
+    long long child_ns;
+    long long cpu_ns;
+} ProfileEntry;
+
+// ProfileContext structure (a script or sourced file under one call stack, entries indexed by line)
+typedef struct ProfileContext
+{
+    char *name;
+    ProfileEntry **lines;
+    long line_cap;
+} ProfileContext;
+
+// Profiler structure (--profile state)
+typedef struct Profiler
+{
+    char *path;
+    int count;
+    // Entries and their command names are carved from blocks, lines are never freed before exit
+    ProfileEntry *pool;
+    int pool_left;
+    char *arena;
+    size_t arena_left;
+    // Call contexts, the current one (-1 outside any) and the line being run in it
+    ProfileContext *contexts;
+    int context_count;
+    int context_cap;
+    int context;
+    ProfileEntry *current;
+    // Running totals, lines take differences to get their own share
+    long long child_wall_ns;
+    long long child_cpu_ns;
+    long long nested_ns;
+    long long nested_child_ns;
+    long long nested_cpu_ns;
+} Profiler;
+
+// ProfileMark structure (totals when a line started)
+typedef struct ProfileMark
+{
+    ProfileEntry *entry;
+    ProfileEntry *previous;
+    long long start_ns;
+    long long child_wall_ns;
+    long long child_cpu_ns;
+    long long nested_ns;
+    long long nested_child_ns;
+    long long nested_cpu_ns;
+} ProfileMark;
+
+// TraceRecord structure (one command run by handle_command, end_ns 0 while it runs)
+typedef struct TraceRecord
+{
+    int64_t start_ns;
+    int64_t end_ns;
+    long line;
+    pid_t pid;
+    int exit_code;
+    char text[TRACE_TEXT];
+} TraceRecord;
+
+// Tracer structure (ring of the latest commands, next counts every command ever started)
+typedef struct Tracer
+{
+    TraceRecord records[TRACE_RECORDS];
+    unsigned long next;
+    // Record of the innermost running command, spawn_command stamps its child's pid here
+    TraceRecord *current;
+    // set -x writes every finished record to stderr
+    int xtrace;
+} Tracer;
+
+// SchedSettings structure (run builtin, applied in the child before exec, unset fields keep the shell's own)
+typedef struct SchedSettings
+{
+    int cpu_count;
+    cpu_set_t cpus;
+    // Each child gets the next CPU of the set instead of the whole set
+    int spread;
+    int nice_set;
+    int nice;
+    int policy;
+    int io_class;
+    int io_level;
+} SchedSettings;
+
+// SourceLine structure (a command line of a sourced file, blank and comment lines are dropped when parsing)
+typedef struct SourceLine
+{
+    long offset;
+    long length;
+    long number;
+} SourceLine;
+
+// SourceFile structure (a sourced file read and split into lines, valid while device, inode, mtime and size match)
+typedef struct SourceFile
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    char *text;
+    SourceLine *lines;
+    int line_count;
+    // Runs in progress, a stale entry (replaced or never cached) is freed by the last one
+    int users;
+    int stale;
+    long long last_used;
+} SourceFile;
+
+// SourceCache structure (source and . builtins)
+typedef struct SourceCache
+{
+    SourceFile *files[SOURCE_CACHE_MAX];
+    int count;
+    int depth;
+    long long clock;
+} SourceCache;
+
+// ShellOptions structure (script wide settings from the command line)
+typedef struct ShellOptions
+{
+    char *capture_dir;
+    CaptureLog capture;
+    long line_number;
+    long long cmd_timeout_ns;
+    long long kill_after_ns;
+    rlim_t limits[LIMIT_COUNT];
+    // set -o argsplit, and the split prefix's job count for the current command (0 when not splitting)
+    int argsplit;
+    long split_jobs;
+    // Words the current line's globs expanded to, the only ones split spreads over batches
+    GlobMatches *split_words;
+    Journal journal;
+    Profiler profile;
+    Tracer trace;
+    FileCache files;
+    // Defaults from run without a command, swapped for the run prefix, and the next CPU handed out when spreading
+    SchedSettings sched;
+    unsigned long next_cpu;
+    SourceCache sources;
+    // Set when an external command is stopped by its timeout, a real exit code of 124 leaves it clear
+    int timed_out;
+    // Descriptors exec has set (bit per descriptor), and a counter bumped by set, ulimit, run defaults and exec
+    unsigned exec_fds;
+    long settings_generation;
+} ShellOptions;
+
 // Header needed for history callback
+int run_command(char **args, int arg_count, LocalVariableList *local, History *history, int prev_rc, FILE *file);
 int handle_command(char **args, int arg_count, Redirect *redirect, LocalVariableList *local, History *history, int prev_rc, FILE *file);
+
+// Header needed for process substitution (the substituted command runs as a line of its own)
+int handle_argument(char *input, LocalVariableList *local, History *history, int prev_rc, FILE *file);
+
+// Header needed for timing the lines of sourced files
+ProfileMark profile_begin_line(Profiler *profile, long line, const char *input);
+void profile_end_line(Profiler *profile, ProfileMark *mark);
+int profile_push_context(Profiler *profile, const char *name);
+void profile_pop_context(Profiler *profile, int previous);
+
+// Header needed for refusing to cache builtins
+int is_builtin(const char *name);
+
+// Header needed for writing the profile from exit
+void profile_finish(Profiler *profile);
+
+// Header needed for dumping the trace from exit
+void trace_dump(Tracer *trace, int fd);